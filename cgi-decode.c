@@ -12,16 +12,6 @@
 #define BUFFER_SIZE 0x100000
 #define SCAN_DEBUG_MASK 0x3FFFFF
 
-static unsigned char checkMask[] =  {0x00, 0x01, 0x00, 0x02, 0x00, 0x04, 0x00, 0x08, 0x00, 0x10, 0x00, 0x20, 0x00, 0x40, 0x00, 0x80};
-
-static int  bitCount[] =            {0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,
-                                     1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,
-                                     1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,
-                                     2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,
-                                     1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,
-                                     2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,
-                                     2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,
-                                     3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,4,5,5,6,5,6,6,7,5,6,6,7,6,7,7,8};
 
 
 static void exitDiscoveryMismatch(const char * message, long long count) {
@@ -74,7 +64,8 @@ static long long stringToLongLong(const char * string) {
 
 
 
-static void writePrimeText(Prime from, Prime to, size_t range, int fd, int file, const char * fileName,
+// wheel selects the skip "2,3,5" bitmap layout, otherwise skip is "2" (see output.h)
+static void writePrimeText(Prime from, Prime to, size_t range, int wheel, int fd, int file, const char * fileName,
         long long expectedTextSize, long long primesExpected) {
 
     Prime prime_3;
@@ -82,9 +73,20 @@ static void writePrimeText(Prime from, Prime to, size_t range, int fd, int file,
     int disallow2;
     disallow2 = prime_eq(from, prime_3);
 
+    Prime base;
+    prime_cp(base, from);
+    int span = ODD_SPAN;
+    const unsigned char * residues = oddResidues;
+    if (wheel) {
+        Prime baseOffset;
+        prime_mod_num(baseOffset, from, WHEEL_SPAN);
+        prime_sub_prime(base, from, baseOffset);
+        span = WHEEL_SPAN;
+        residues = wheelResidues;
+    }
+
     char writeBuffer[BUFFER_SIZE];
     unsigned char bitmap[BUFFER_SIZE];
-    size_t readBufferContent=0;
 
     size_t remainingBuffer = BUFFER_SIZE;
     char * bufferWritePos = writeBuffer;
@@ -92,7 +94,22 @@ static void writePrimeText(Prime from, Prime to, size_t range, int fd, int file,
     Prime prime_2;
     prime_set_num(prime_2, 2);
 
-    if (prime_le(from, prime_2) && prime_ge(to, prime_2) && !disallow2) {
+    if (wheel) {
+        static const unsigned int wheelPrimes[] = {2, 3, 5};
+        for (int i = 0; i < 3; ++i) {
+            Prime value;
+            prime_set_num(value, wheelPrimes[i]);
+            if (prime_le(from, value) && prime_lt(value, to)) {
+                bufferWritePos[0] = '0' + wheelPrimes[i];
+                bufferWritePos[1] = '\n';
+                bufferWritePos += 2;
+                remainingBuffer -= 2;
+                --primesExpected;
+                expectedTextSize -=2;
+            }
+        }
+    }
+    else if (prime_le(from, prime_2) && prime_ge(to, prime_2) && !disallow2) {
         bufferWritePos[0] = '2';
         bufferWritePos[1] = '\n';
         bufferWritePos += 2;
@@ -101,68 +118,55 @@ static void writePrimeText(Prime from, Prime to, size_t range, int fd, int file,
         expectedTextSize -=2;
     }
 
-    size_t endRange = range -1;
-    size_t readBufferPos = 0;
-    for (size_t i = 0; i < endRange; ++i, ++readBufferPos) {
-        if (readBufferPos >= readBufferContent) {
-            if (range - i >= BUFFER_SIZE) readBufferContent = readSafe(fd, bitmap, BUFFER_SIZE, fileName);
-            else readBufferContent = readSafe(fd, bitmap, range - i, fileName);
-            if (!readBufferContent) exitError(1, 0,
+    // Bits from "to" onwards must be ignored
+    Prime tmp;
+    prime_sub_prime(tmp, to, base);
+    size_t toOffset = range * span;
+    Prime limit;
+    prime_set_num(limit, toOffset);
+    if (prime_lt(tmp, limit)) toOffset = prime_get_num(tmp);
+
+    DecimalString decimal;
+    setDecimalString(&decimal, base);
+    size_t decimalOffset = 0;
+    unsigned short bits[BITMAP_BLOCK_SIZE * 8];
+    for (size_t readStart = 0; readStart < range;) {
+        size_t readSize = range - readStart;
+        if (readSize > BUFFER_SIZE) readSize = BUFFER_SIZE;
+        for (size_t readPos = 0; readPos < readSize;) {
+            size_t bytesRead = readSafe(fd, bitmap + readPos, readSize - readPos, fileName);
+            if (!bytesRead) exitError(1, 0,
                     "Unexpected end of file while decompressing %s, read %zd, expected %zd more bytes",
-                    fileName, i, range - i);
-            else readBufferPos = 0;
+                    fileName, readStart + readPos, range - readStart - readPos);
+            readPos += bytesRead;
         }
 
-        if (verbose && !(i & SCAN_DEBUG_MASK))
-            stdLog("Writing primes as text %02.2f%%", 100 * ((double) i)/((double) range));
+        for (size_t blockStart = 0; blockStart < readSize; blockStart += BITMAP_BLOCK_SIZE) {
+            if (verbose && !((readStart + blockStart) & SCAN_DEBUG_MASK))
+                stdLog("Writing primes as text %02.2f%%", 100 * ((double) (readStart + blockStart))/((double) range));
 
-        if (bitmap[readBufferPos]) {
-            if (remainingBuffer < PRIME_STRING_SIZE * bitCount[bitmap[readBufferPos]]) {
+            size_t blockSize = readSize - blockStart;
+            if (blockSize > BITMAP_BLOCK_SIZE) blockSize = BITMAP_BLOCK_SIZE;
+            size_t count = getBitmapBits(bitmap + blockStart, blockSize, bits);
+            if (remainingBuffer < PRIME_STRING_SIZE * count) {
                 writeSafe(file, writeBuffer, BUFFER_SIZE - remainingBuffer);
                 bufferWritePos = writeBuffer;
                 remainingBuffer = BUFFER_SIZE;
             }
-            for (int j = 1; j < 16; j+=2) {
-                if (bitmap[readBufferPos] & checkMask[j]) {
-                    --primesExpected;
-                    Prime value;
-                    getPrimeFromMap(value, from, i, j);
-                    int bytesWritten = prime_to_str(bufferWritePos, value);
-                    expectedTextSize -= bytesWritten + 1;
-                    bufferWritePos[bytesWritten] = '\n';
-                    bufferWritePos += bytesWritten + 1;
-                    remainingBuffer -= bytesWritten + 1;
-                }
-            }
-        }
-    }
-
-    if (!readBufferPos >= readBufferContent) {
-        readBufferContent = readSafe(fd, bitmap, 1, fileName);
-        if (!readBufferContent) exitError(1, 0, "Unexpected end of file while decompressing %s", fileName);
-        else readBufferPos = 0;
-    }
-
-    if (bitmap[readBufferPos]) {
-       if (remainingBuffer < PRIME_STRING_SIZE * bitCount[bitmap[readBufferPos]]) {
-            writeSafe(file, writeBuffer, BUFFER_SIZE - remainingBuffer);
-            bufferWritePos = writeBuffer;
-            remainingBuffer = BUFFER_SIZE;
-        }
-        for (int j = 1; j < 16; j+=2) {
-            if (bitmap[readBufferPos] & checkMask[j]) {
-                Prime value;
-                getPrimeFromMap(value, from, endRange, j);
-                if (prime_lt(value, to)) {
-                    --primesExpected;
-                    int bytesWritten = prime_to_str(bufferWritePos, value);
-                    expectedTextSize -= bytesWritten +1;
-                    bufferWritePos[bytesWritten] = '\n';
-                    bufferWritePos += bytesWritten + 1;
-                    remainingBuffer -= bytesWritten + 1;
-                }
+            for (size_t i = 0; i < count; ++i) {
+                size_t offset = (readStart + blockStart + (bits[i] >> 3)) * span + residues[bits[i] & 7];
+                if (offset >= toOffset) break;
+                addToDecimalString(&decimal, offset - decimalOffset);
+                decimalOffset = offset;
+                --primesExpected;
+                size_t bytesWritten = copyDecimalString(bufferWritePos, &decimal);
+                expectedTextSize -= bytesWritten + 1;
+                bufferWritePos[bytesWritten] = '\n';
+                bufferWritePos += bytesWritten + 1;
+                remainingBuffer -= bytesWritten + 1;
             }
         }
+        readStart += readSize;
     }
 
     writeSafe(file, writeBuffer, BUFFER_SIZE - remainingBuffer);
@@ -173,8 +177,6 @@ static void writePrimeText(Prime from, Prime to, size_t range, int fd, int file,
 
 
 
-#define forceNullTerminate(field) field[sizeof(field)-1] = '\0'
-
 int readHeader(int file, CompressedBinaryHeader * header, const char * fileName) {
     size_t bytesRead = readSafe(file, header, sizeof(CompressedBinaryHeader), fileName);
     if (!bytesRead) return 0;
@@ -206,9 +208,10 @@ int readHeader(int file, CompressedBinaryHeader * header, const char * fileName)
     // Check that everything matches out expectations
     // Again this is built to check the file matches one that my
     // code generated, although the file supports more, this program currently doesn't.
-    if (strcmp(COMPRESSED_BINARY_SIGNATURE, header->signature))
-        exitError(1,0, "Invalid file header.  Wanted %s, found %s",
-                COMPRESSED_BINARY_SIGNATURE, header->signature);
+    int version_1_1 = !strcmp(COMPRESSED_BINARY_SIGNATURE_1_1, header->signature);
+    if (strcmp(COMPRESSED_BINARY_SIGNATURE, header->signature) && !version_1_1)
+        exitError(1,0, "Invalid file header.  Wanted %s or %s, found %s",
+                COMPRESSED_BINARY_SIGNATURE, COMPRESSED_BINARY_SIGNATURE_1_1, header->signature);
 
     if (stringToSizeT(header->headerSize) != sizeof(CompressedBinaryHeader))
         exitError(1,0, "File header declared invalid size. Wanted %zd, found %s",
@@ -218,8 +221,9 @@ int readHeader(int file, CompressedBinaryHeader * header, const char * fileName)
         exitError(1,0, "File header declared invalid from/to size.  Wanted %zd, found %s",
                 sizeof(header->fromToSize), header->fromToSize);
 
-    if (strcmp("2", header->skip))
-        exitError(1, 0, "File header declared invalid skip value.  Wanted 2. Found %s",
+    if (strcmp(COMPRESSED_BINARY_SKIP_ODD, header->skip) && !(version_1_1 && !strcmp(COMPRESSED_BINARY_SKIP_WHEEL, header->skip)))
+        exitError(1, 0, "File header declared invalid skip value.  Wanted %s. Found %s",
+                version_1_1 ? COMPRESSED_BINARY_SKIP_ODD " or " COMPRESSED_BINARY_SKIP_WHEEL : COMPRESSED_BINARY_SKIP_ODD,
                 header->skip);
 
     return 1;
@@ -268,7 +272,8 @@ static void decompress(int inputFile, const char * fileName) {
         str_to_prime(to, header.to);
 
         
-        writePrimeText(from, to, bufferSize, inputFile, outputFile, fileName, expectedTextSize, primesExpected);
+        int wheel = !strcmp(COMPRESSED_BINARY_SKIP_WHEEL, header.skip);
+        writePrimeText(from, to, bufferSize, wheel, inputFile, outputFile, fileName, expectedTextSize, primesExpected);
     }
 }
 
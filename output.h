@@ -3,11 +3,27 @@
 
 #include "prime_shared.h"
 
+#include <stdint.h>
+#include <string.h>
+
 #define COMPRESSED_BINARY_SIGNATURE "Compressed Prime Binary: 1.0"
+#define COMPRESSED_BINARY_SIGNATURE_1_1 "Compressed Prime Binary: 1.1"
+
+// Skip values.  Version 1.0 only allows "2", version 1.1 also allows "2,3,5".
+#define COMPRESSED_BINARY_SKIP_ODD "2"
+#define COMPRESSED_BINARY_SKIP_WHEEL "2,3,5"
+
+// Bitmap layouts
+// Each byte represents the 8 numbers in a span of 16 (skip "2") or 30 (skip "2,3,5") which are not
+// multiples of a skipped prime.  The low significant bit represents the smallest.
+#define ODD_SPAN 16
+#define WHEEL_SPAN 30
+static const unsigned char oddResidues[8]   = {1, 3, 5, 7, 9, 11, 13, 15};
+static const unsigned char wheelResidues[8] = {1, 7, 11, 13, 17, 19, 23, 29};
 
 // Header for compressed binary
 typedef struct {            // All header fields are text (UTF-8) NOT binary
-    char signature[32];     // Literally: "Compressed Prime Binary: 1.0"
+    char signature[32];     // Literally: "Compressed Prime Binary: 1.0" or "Compressed Prime Binary: 1.1"
     char headerSize[32];    // The size of this structure: sizeof(CompressedBinaryHeader)
                             // Extensions to this format may increase this from 1024 adding additional fields at the endRange
                             // Extensions should keep this size as a multiple of 1024.
@@ -16,19 +32,191 @@ typedef struct {            // All header fields are text (UTF-8) NOT binary
     char primeCount[32];    // The number of primes found in this file
     char textSize[32];      // The number of bytes in an askii representation of this file this includes one byte per prime for a delimiting \n character.
     char comments[288];     // Anything may be written here as long as it's UTF-8
-    char skip[32];          // Comma separated list of primes who's multiples are not in the bitmap.  This is current just "2".
+    char skip[32];          // Comma separated list of primes who's multiples are not in the bitmap.  Either "2" or "2,3,5".
     char from[256];         // The offset for this bitmap including skipped numbers.
                             // Eg: from "1000" skip "2" - the first bit will represent 1001.
                             // Eg: from "5000" skip "2,3" - the first bit will represent 5003.
+                            // With skip "2,3,5" the bitmap starts at from rounded down to a multiple of 30
+                            // Eg: from "1000" skip "2,3,5" - the first bit will represent 991.  Bits below from are 0.
+                            // Skipped primes are part of the file if they lie between from (inc) and to (ex).
     char to[256];           // The upper limit of this data file.  De-compressors MUST ignore all bits >= to this.
 } __attribute__ ((packed)) CompressedBinaryHeader;
 
 
 
+// Gap coded archives (see prime -g) store the odd primes from (inc) to to (ex) by the gaps between them.
+// 2 is never stored, like the compressed binary it is part of the file if it lies between from (inc) and to (ex).
+// The data block is a restart index followed by the gaps:
+//   The restart index has an entry for the first prime and every restartInterval primes after it.  Each is two
+//   64 bit little endian values: the prime's offset from "from" and the position (in the gaps) of the gap after it.
+//   Every other prime is stored as half the gap from the prime before.  Half gaps of 1 to 255 are a single byte.
+//   Anything larger is a 0 byte followed by the half gap in base 128, least significant first, with the top bit
+//   set on every byte but the last.
+#define GAP_CODED_SIGNATURE "Gap Coded Prime Archive: 1.0"
+#define GAP_RESTART_INTERVAL 0x1000
+#define GAP_RESTART_ENTRY_SIZE 16
+#define GAP_CODE_MAX_SIZE 11        // The escape and a 64 bit half gap in base 128
+
+// The header is the same size as CompressedBinaryHeader, with the same first 6 fields, so either may be read first.
+typedef struct {            // All header fields are text (UTF-8) NOT binary
+    char signature[32];     // Literally: "Gap Coded Prime Archive: 1.0"
+    char headerSize[32];    // The size of this structure: sizeof(GapCodedHeader)
+    char dataBlockSize[32]; // The size of the data block following this header (restart index and gaps)
+    char fromToSize[32];    // The size of the from and to fields in this header (ie: 256)
+    char primeCount[32];    // The number of primes found in this file (including 2)
+    char textSize[32];      // The number of bytes in an askii representation of this file including one \n per prime
+    char restartInterval[32]; // The number of primes between restart index entries
+    char restartCount[32];  // The number of entries in the restart index
+    char gapsSize[32];      // The size of the gaps following the restart index
+    char comments[224];     // Anything may be written here as long as it's UTF-8
+    char from[256];         // The lower limit of this file, restart offsets are from this value
+    char to[256];           // The upper limit of this file
+} __attribute__ ((packed)) GapCodedHeader;
+
+static inline void putLittleEndian64(unsigned char * target, uint64_t value) {
+    for (int i = 0; i < 8; ++i) target[i] = value >> (i * 8);
+}
+
+
+
+static inline uint64_t getLittleEndian64(const unsigned char * source) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; --i) value = (value << 8) | source[i];
+    return value;
+}
+
+
+
+// Writes half a gap, returning the number of bytes used (no more than GAP_CODE_MAX_SIZE)
+static inline size_t putGapCode(unsigned char * target, uint64_t halfGap) {
+    if (halfGap && halfGap < 0x100) {
+        target[0] = halfGap;
+        return 1;
+    }
+    size_t size = 1;
+    target[0] = 0;
+    while (halfGap >= 0x80) {
+        target[size++] = 0x80 | (halfGap & 0x7F);
+        halfGap >>= 7;
+    }
+    target[size++] = halfGap;
+    return size;
+}
+
+
+
+// Init files hold the sieving primes (see prime -j and -i) in a form that can be mapped straight into memory.
+// The primes are native SievePrime values in ascending order, immediately after the header.
+#define INIT_FILE_SIGNATURE "Prime Init File: 1.0"
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    #define INIT_FILE_BYTE_ORDER "big"
+#else
+    #define INIT_FILE_BYTE_ORDER "little"
+#endif
+
+typedef struct {            // All header fields are text (UTF-8) NOT binary
+    char signature[32];     // Literally: "Prime Init File: 1.0"
+    char headerSize[32];    // The size of this structure: sizeof(InitFileHeader), the primes start here
+    char primeSize[32];     // The size of each prime in bytes (4 for prime-64, 8 for prime-gmp and prime-128)
+    char byteOrder[32];     // "little" or "big"
+    char primeCount[32];    // The number of primes in the file
+    char comments[352];     // Anything may be written here as long as it's UTF-8
+    char maxPrime[256];     // Every odd prime up to and including this is in the file (and no others)
+    char reserved[256];     // Zero
+} __attribute__ ((packed)) InitFileHeader;
+
+
+
+// Header fields are not necessarily null terminated in a file
+#define forceNullTerminate(field) field[sizeof(field)-1] = '\0'
+
+#define getPrimeFromBitmap(value, base, byteIndex, bit, span, residues) {\
+    prime_set_num(value, byteIndex);\
+    prime_mul_num(value, value, span);\
+    prime_add_num(value, value, residues[bit]);\
+    prime_add_prime(value, value, base);\
+}
+
 #define getPrimeFromMap(value, offset, byteIndex, bitIndex) {\
     prime_set_num(value, byteIndex);\
     prime_mul_16(value, value);\
     prime_add_num(value, value, bitIndex);\
     prime_add_prime(value, value, offset);\
 }
+
+
+
+// Writers scan bitmaps in blocks of this many bytes, see getBitmapBits()
+#define BITMAP_BLOCK_SIZE 0x200
+
+// Finds every set bit in a block of a bitmap (no more than BITMAP_BLOCK_SIZE bytes) in ascending order.
+// Each is written to bits as byteIndex * 8 + bit, returning how many were found.
+// The bitmap is read 64 bits at a time, taking the lowest set bit until the word is empty.
+static inline size_t getBitmapBits(const unsigned char * bitmap, size_t size, unsigned short * bits) {
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, bitmap + i, sizeof(uint64_t));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        while (word) {
+            bits[count++] = i * 8 + __builtin_ctzll(word);
+            word &= word - 1;
+        }
+    }
+    for (; i < size; ++i) {
+        unsigned int byte = bitmap[i];
+        while (byte) {
+            bits[count++] = i * 8 + __builtin_ctz(byte);
+            byte &= byte - 1;
+        }
+    }
+    return count;
+}
+
+
+
+// A decimal string which can be moved on by small amounts without formatting the whole number again.
+// Text writers only ever move forwards through a bitmap so each prime is written by adding the gap from the last.
+typedef struct DecimalString {
+    char digits[PRIME_STRING_SIZE];     // Right aligned, not null terminated
+    char * start;                       // The first (most significant) digit
+} DecimalString;
+
+static inline void setDecimalString(DecimalString * decimal, Prime value) {
+    PrimeString valueString;
+    prime_to_str(valueString, value);
+    size_t length = strlen(valueString);
+    decimal->start = decimal->digits + PRIME_STRING_SIZE - length;
+    memcpy(decimal->start, valueString, length);
+}
+
+
+
+static inline void addToDecimalString(DecimalString * decimal, size_t value) {
+    char * digit = decimal->digits + PRIME_STRING_SIZE - 1;
+    unsigned int carry = 0;
+    while (value || carry) {
+        if (digit < decimal->start) {
+            *digit = '0';
+            decimal->start = digit;
+        }
+        unsigned int sum = (*digit - '0') + (value % 10) + carry;
+        value /= 10;
+        carry = sum >= 10;
+        *digit = '0' + (carry ? sum - 10 : sum);
+        --digit;
+    }
+}
+
+
+
+// Copies the digits to target (without a terminator) returning how many were copied
+static inline size_t copyDecimalString(char * target, const DecimalString * decimal) {
+    size_t length = decimal->digits + PRIME_STRING_SIZE - decimal->start;
+    memcpy(target, decimal->start, length);
+    return length;
+}
 #endif
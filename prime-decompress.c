@@ -12,16 +12,6 @@
 #define BUFFER_SIZE 0x100000
 #define SCAN_DEBUG_MASK 0x3FFFFF
 
-static unsigned char checkMask[] =  {0x00, 0x01, 0x00, 0x02, 0x00, 0x04, 0x00, 0x08, 0x00, 0x10, 0x00, 0x20, 0x00, 0x40, 0x00, 0x80};
-
-static int  bitCount[] =            {0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,
-                                     1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,
-                                     1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,
-                                     2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,
-                                     1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,
-                                     2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,
-                                     2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,
-                                     3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,4,5,5,6,5,6,6,7,5,6,6,7,6,7,7,8};
 
 
 static void writeSafe(int file, const void * buffer, size_t size) {
@@ -74,7 +64,8 @@ static void exitDiscoveryMismatch(const char * message, long long count) {
 
 
 
-static void writePrimeText(Prime from, Prime to, size_t range, int fd, int file, const char * fileName,
+// wheel selects the skip "2,3,5" bitmap layout, otherwise skip is "2" (see output.h)
+static void writePrimeText(Prime from, Prime to, size_t range, int wheel, int fd, int file, const char * fileName,
         long long expectedTextSize, long long primesExpected) {
 
     Prime prime_3;
@@ -82,9 +73,20 @@ static void writePrimeText(Prime from, Prime to, size_t range, int fd, int file,
     int disallow2;
     disallow2 = prime_eq(from, prime_3);
 
+    Prime base;
+    prime_cp(base, from);
+    int span = ODD_SPAN;
+    const unsigned char * residues = oddResidues;
+    if (wheel) {
+        Prime baseOffset;
+        prime_mod_num(baseOffset, from, WHEEL_SPAN);
+        prime_sub_prime(base, from, baseOffset);
+        span = WHEEL_SPAN;
+        residues = wheelResidues;
+    }
+
     char writeBuffer[BUFFER_SIZE];
     unsigned char bitmap[BUFFER_SIZE];
-    size_t readBufferContent=0;
 
     size_t remainingBuffer = BUFFER_SIZE;
     char * bufferWritePos = writeBuffer;
@@ -92,7 +94,22 @@ static void writePrimeText(Prime from, Prime to, size_t range, int fd, int file,
     Prime prime_2;
     prime_set_num(prime_2, 2);
 
-    if (prime_le(from, prime_2) && prime_ge(to, prime_2) && !disallow2) {
+    if (wheel) {
+        static const unsigned int wheelPrimes[] = {2, 3, 5};
+        for (int i = 0; i < 3; ++i) {
+            Prime value;
+            prime_set_num(value, wheelPrimes[i]);
+            if (prime_le(from, value) && prime_lt(value, to)) {
+                bufferWritePos[0] = '0' + wheelPrimes[i];
+                bufferWritePos[1] = '\n';
+                bufferWritePos += 2;
+                remainingBuffer -= 2;
+                --primesExpected;
+                expectedTextSize -=2;
+            }
+        }
+    }
+    else if (prime_le(from, prime_2) && prime_ge(to, prime_2) && !disallow2) {
         bufferWritePos[0] = '2';
         bufferWritePos[1] = '\n';
         bufferWritePos += 2;
@@ -101,68 +118,55 @@ static void writePrimeText(Prime from, Prime to, size_t range, int fd, int file,
         expectedTextSize -=2;
     }
 
-    size_t endRange = range -1;
-    size_t readBufferPos = 0;
-    for (size_t i = 0; i < endRange; ++i, ++readBufferPos) {
-        if (readBufferPos >= readBufferContent) {
-            if (range - i >= BUFFER_SIZE) readBufferContent = readSafe(fd, bitmap, BUFFER_SIZE, fileName);
-            else readBufferContent = readSafe(fd, bitmap, range - i, fileName);
-            if (!readBufferContent) exitError(1, 0,
+    // Bits from "to" onwards must be ignored
+    Prime tmp;
+    prime_sub_prime(tmp, to, base);
+    size_t toOffset = range * span;
+    Prime limit;
+    prime_set_num(limit, toOffset);
+    if (prime_lt(tmp, limit)) toOffset = prime_get_num(tmp);
+
+    DecimalString decimal;
+    setDecimalString(&decimal, base);
+    size_t decimalOffset = 0;
+    unsigned short bits[BITMAP_BLOCK_SIZE * 8];
+    for (size_t readStart = 0; readStart < range;) {
+        size_t readSize = range - readStart;
+        if (readSize > BUFFER_SIZE) readSize = BUFFER_SIZE;
+        for (size_t readPos = 0; readPos < readSize;) {
+            size_t bytesRead = readSafe(fd, bitmap + readPos, readSize - readPos, fileName);
+            if (!bytesRead) exitError(1, 0,
                     "Unexpected end of file while decompressing %s, read %zd, expected %zd more bytes",
-                    fileName, i, range - i);
-            else readBufferPos = 0;
+                    fileName, readStart + readPos, range - readStart - readPos);
+            readPos += bytesRead;
         }
 
-        if (verbose && !(i & SCAN_DEBUG_MASK))
-            stdLog("Writing primes as text %02.2f%%", 100 * ((double) i)/((double) range));
+        for (size_t blockStart = 0; blockStart < readSize; blockStart += BITMAP_BLOCK_SIZE) {
+            if (verbose && !((readStart + blockStart) & SCAN_DEBUG_MASK))
+                stdLog("Writing primes as text %02.2f%%", 100 * ((double) (readStart + blockStart))/((double) range));
 
-        if (bitmap[readBufferPos]) {
-            if (remainingBuffer < PRIME_STRING_SIZE * bitCount[bitmap[readBufferPos]]) {
+            size_t blockSize = readSize - blockStart;
+            if (blockSize > BITMAP_BLOCK_SIZE) blockSize = BITMAP_BLOCK_SIZE;
+            size_t count = getBitmapBits(bitmap + blockStart, blockSize, bits);
+            if (remainingBuffer < PRIME_STRING_SIZE * count) {
                 writeSafe(file, writeBuffer, BUFFER_SIZE - remainingBuffer);
                 bufferWritePos = writeBuffer;
                 remainingBuffer = BUFFER_SIZE;
             }
-            for (int j = 1; j < 16; j+=2) {
-                if (bitmap[readBufferPos] & checkMask[j]) {
-                    --primesExpected;
-                    Prime value;
-                    getPrimeFromMap(value, from, i, j);
-                    int bytesWritten = prime_to_str(bufferWritePos, value);
-                    expectedTextSize -= bytesWritten + 1;
-                    bufferWritePos[bytesWritten] = '\n';
-                    bufferWritePos += bytesWritten + 1;
-                    remainingBuffer -= bytesWritten + 1;
-                }
-            }
-        }
-    }
-
-    if (!readBufferPos >= readBufferContent) {
-        readBufferContent = readSafe(fd, bitmap, 1, fileName);
-        if (!readBufferContent) exitError(1, 0, "Unexpected end of file while decompressing %s", fileName);
-        else readBufferPos = 0;
-    }
-
-    if (bitmap[readBufferPos]) {
-       if (remainingBuffer < PRIME_STRING_SIZE * bitCount[bitmap[readBufferPos]]) {
-            writeSafe(file, writeBuffer, BUFFER_SIZE - remainingBuffer);
-            bufferWritePos = writeBuffer;
-            remainingBuffer = BUFFER_SIZE;
-        }
-        for (int j = 1; j < 16; j+=2) {
-            if (bitmap[readBufferPos] & checkMask[j]) {
-                Prime value;
-                getPrimeFromMap(value, from, endRange, j);
-                if (prime_lt(value, to)) {
-                    --primesExpected;
-                    int bytesWritten = prime_to_str(bufferWritePos, value);
-                    expectedTextSize -= bytesWritten +1;
-                    bufferWritePos[bytesWritten] = '\n';
-                    bufferWritePos += bytesWritten + 1;
-                    remainingBuffer -= bytesWritten + 1;
-                }
+            for (size_t i = 0; i < count; ++i) {
+                size_t offset = (readStart + blockStart + (bits[i] >> 3)) * span + residues[bits[i] & 7];
+                if (offset >= toOffset) break;
+                addToDecimalString(&decimal, offset - decimalOffset);
+                decimalOffset = offset;
+                --primesExpected;
+                size_t bytesWritten = copyDecimalString(bufferWritePos, &decimal);
+                expectedTextSize -= bytesWritten + 1;
+                bufferWritePos[bytesWritten] = '\n';
+                bufferWritePos += bytesWritten + 1;
+                remainingBuffer -= bytesWritten + 1;
             }
         }
+        readStart += readSize;
     }
 
     writeSafe(file, writeBuffer, BUFFER_SIZE - remainingBuffer);
@@ -219,7 +223,130 @@ static void writePrimeSystemBinary(Prime from, Prime to, size_t range, int bitma
 */
 
 
-#define forceNullTerminate(field) field[sizeof(field)-1] = '\0'
+
+// Reads size bytes, anything less is an error
+static void readBlock(int fd, void * buffer, size_t size, const char * fileName) {
+    for (size_t readPos = 0; readPos < size;) {
+        size_t bytesRead = readSafe(fd, ((unsigned char *) buffer) + readPos, size - readPos, fileName);
+        if (!bytesRead) exitError(1, 0, "Unexpected end of file while decompressing %s, read %zd, expected %zd more bytes",
+                fileName, readPos, size - readPos);
+        readPos += bytesRead;
+    }
+}
+
+
+
+// Decodes a gap coded block (see GapCodedHeader) to text.  The whole block is read in one go, the gaps between
+// each pair of restart points are then decoded until they reach the next restart point.
+static void writeGapText(GapCodedHeader * header, int fd, int file, const char * fileName) {
+    Prime from, to, tmp;
+    str_to_prime(from, header->from);
+    str_to_prime(to, header->to);
+    long long expectedTextSize = stringToLongLong(header->textSize);
+    long long primesExpected = stringToLongLong(header->primeCount);
+    size_t restartCount = stringToSizeT(header->restartCount);
+    size_t gapsSize = stringToSizeT(header->gapsSize);
+    size_t dataSize = stringToSizeT(header->dataBlockSize);
+    if (dataSize != restartCount * GAP_RESTART_ENTRY_SIZE + gapsSize)
+        exitError(1, 0, "Gap coded block in %s has a data block size of %zd, expected %zd", fileName, dataSize,
+                restartCount * GAP_RESTART_ENTRY_SIZE + gapsSize);
+    prime_sub_prime(tmp, to, from);
+    uint64_t toOffset = prime_get_num(tmp);
+
+    unsigned char * data = mallocSafe(dataSize + 1);
+    readBlock(fd, data, dataSize, fileName);
+    const unsigned char * restartIndex = data;
+    const unsigned char * gaps = data + restartCount * GAP_RESTART_ENTRY_SIZE;
+    const unsigned char * gapsEnd = gaps + gapsSize;
+
+    char writeBuffer[BUFFER_SIZE];
+    size_t remainingBuffer = BUFFER_SIZE;
+    char * bufferWritePos = writeBuffer;
+
+    // 2 is never stored
+    Prime prime_2;
+    prime_set_num(prime_2, 2);
+    if (prime_le(from, prime_2) && prime_lt(prime_2, to)) {
+        bufferWritePos[0] = '2';
+        bufferWritePos[1] = '\n';
+        bufferWritePos += 2;
+        remainingBuffer -= 2;
+        --primesExpected;
+        expectedTextSize -= 2;
+    }
+
+    DecimalString decimal;
+    setDecimalString(&decimal, from);
+    uint64_t decimalOffset = 0;
+    const unsigned char * position = gaps;
+    for (size_t restart = 0; restart < restartCount; ++restart) {
+        if (verbose && !(restart & 0xFF))
+            stdLog("Writing primes as text %02.2f%%", 100 * ((double) restart)/((double) restartCount));
+
+        const unsigned char * entry = restartIndex + restart * GAP_RESTART_ENTRY_SIZE;
+        uint64_t offset = getLittleEndian64(entry);
+        if (gaps + getLittleEndian64(entry + 8) != position)
+            exitError(1, 0, "Restart point %zd in %s does not follow the gaps before it", restart, fileName);
+        if (restart && offset <= decimalOffset)
+            exitError(1, 0, "Restart point %zd in %s does not follow the prime before it", restart, fileName);
+
+        // Every prime in the run must be below the next restart point
+        const unsigned char * runEnd = gapsEnd;
+        uint64_t runLimit = toOffset;
+        if (restart + 1 < restartCount) {
+            uint64_t next = getLittleEndian64(entry + GAP_RESTART_ENTRY_SIZE + 8);
+            if (next > gapsSize) exitError(1, 0, "Restart point %zd in %s is beyond the gaps", restart + 1, fileName);
+            runEnd = gaps + next;
+            runLimit = getLittleEndian64(entry + GAP_RESTART_ENTRY_SIZE);
+            if (runLimit > toOffset) runLimit = toOffset;
+        }
+
+        while (1) {
+            if (offset >= runLimit) {
+                if (runLimit == toOffset)
+                    exitError(1, 0, "Gap coded block in %s has a prime outside of its range", fileName);
+                exitError(1, 0, "Gaps before restart point %zd in %s pass it", restart + 1, fileName);
+            }
+            if (remainingBuffer < PRIME_STRING_SIZE) {
+                writeSafe(file, writeBuffer, BUFFER_SIZE - remainingBuffer);
+                bufferWritePos = writeBuffer;
+                remainingBuffer = BUFFER_SIZE;
+            }
+            addToDecimalString(&decimal, offset - decimalOffset);
+            decimalOffset = offset;
+            --primesExpected;
+            size_t bytesWritten = copyDecimalString(bufferWritePos, &decimal);
+            expectedTextSize -= bytesWritten + 1;
+            bufferWritePos[bytesWritten] = '\n';
+            bufferWritePos += bytesWritten + 1;
+            remainingBuffer -= bytesWritten + 1;
+
+            if (position >= runEnd) break;
+            uint64_t halfGap = *(position++);
+            if (!halfGap) {
+                unsigned char byte;
+                int shift = 0;
+                do {
+                    if (position >= runEnd || shift > 63) exitError(1, 0, "Invalid gap in %s", fileName);
+                    byte = *(position++);
+                    halfGap |= ((uint64_t) (byte & 0x7F)) << shift;
+                    shift += 7;
+                } while (byte & 0x80);
+                if (!halfGap) exitError(1, 0, "Invalid gap in %s", fileName);
+            }
+            offset += halfGap * 2;
+        }
+    }
+    if (position != gapsEnd) exitError(1, 0, "Gap coded block in %s has gaps after its last restart point", fileName);
+
+    writeSafe(file, writeBuffer, BUFFER_SIZE - remainingBuffer);
+    free(data);
+
+    if (primesExpected)   exitDiscoveryMismatch("Decompressing found %lld %s primes than expected",   primesExpected);
+    if (expectedTextSize) exitDiscoveryMismatch("Decompressing produced %lld %s bytes than expected", expectedTextSize);
+}
+
+
 
 int readHeader(int file, CompressedBinaryHeader * header, const char * fileName) {
     size_t bytesRead = readSafe(file, header, sizeof(CompressedBinaryHeader), fileName);
@@ -234,6 +361,10 @@ int readHeader(int file, CompressedBinaryHeader * header, const char * fileName)
     }
 
 
+    // Gap coded blocks are checked by readGapCodedHeader()
+    forceNullTerminate(header->signature);
+    if (!strcmp(GAP_CODED_SIGNATURE, header->signature)) return 1;
+
     // TODO accept different header sizes.
     // For now we'll just accept the only thing that my own code will generate and
     // double check that it matches
@@ -252,9 +383,10 @@ int readHeader(int file, CompressedBinaryHeader * header, const char * fileName)
     // Check that everything matches out expectations
     // Again this is built to check the file matches one that my
     // code generated, although the file supports more, this program currently doesn't.
-    if (strcmp(COMPRESSED_BINARY_SIGNATURE, header->signature))
-        exitError(1,0, "Invalid file header.  Wanted %s, found %s",
-                COMPRESSED_BINARY_SIGNATURE, header->signature);
+    int version_1_1 = !strcmp(COMPRESSED_BINARY_SIGNATURE_1_1, header->signature);
+    if (strcmp(COMPRESSED_BINARY_SIGNATURE, header->signature) && !version_1_1)
+        exitError(1,0, "Invalid file header.  Wanted %s or %s, found %s",
+                COMPRESSED_BINARY_SIGNATURE, COMPRESSED_BINARY_SIGNATURE_1_1, header->signature);
 
     if (stringToSizeT(header->headerSize) != sizeof(CompressedBinaryHeader))
         exitError(1,0, "File header declared invalid size. Wanted %zd, found %s",
@@ -264,8 +396,9 @@ int readHeader(int file, CompressedBinaryHeader * header, const char * fileName)
         exitError(1,0, "File header declared invalid from/to size.  Wanted %zd, found %s",
                 sizeof(header->fromToSize), header->fromToSize);
 
-    if (strcmp("2", header->skip))
-        exitError(1, 0, "File header declared invalid skip value.  Wanted 2. Found %s",
+    if (strcmp(COMPRESSED_BINARY_SKIP_ODD, header->skip) && !(version_1_1 && !strcmp(COMPRESSED_BINARY_SKIP_WHEEL, header->skip)))
+        exitError(1, 0, "File header declared invalid skip value.  Wanted %s. Found %s",
+                version_1_1 ? COMPRESSED_BINARY_SKIP_ODD " or " COMPRESSED_BINARY_SKIP_WHEEL : COMPRESSED_BINARY_SKIP_ODD,
                 header->skip);
 
     return 1;
@@ -273,9 +406,51 @@ int readHeader(int file, CompressedBinaryHeader * header, const char * fileName)
 
 
 
+// Checks the fields of a gap coded header which writeGapText() does not
+static void readGapCodedHeader(GapCodedHeader * header, const char * fileName) {
+    forceNullTerminate(header->headerSize);
+    forceNullTerminate(header->dataBlockSize);
+    forceNullTerminate(header->fromToSize);
+    forceNullTerminate(header->primeCount);
+    forceNullTerminate(header->textSize);
+    forceNullTerminate(header->restartInterval);
+    forceNullTerminate(header->restartCount);
+    forceNullTerminate(header->gapsSize);
+    forceNullTerminate(header->comments);
+    forceNullTerminate(header->from);
+    forceNullTerminate(header->to);
+
+    if (stringToSizeT(header->headerSize) != sizeof(GapCodedHeader))
+        exitError(1,0, "File header declared invalid size. Wanted %zd, found %s",
+                sizeof(GapCodedHeader), header->headerSize);
+
+    if (stringToSizeT(header->fromToSize) != sizeof(header->from))
+        exitError(1,0, "File header declared invalid from/to size.  Wanted %zd, found %s",
+                sizeof(header->from), header->fromToSize);
+
+    if (!stringToSizeT(header->restartInterval))
+        exitError(1,0, "File header declared invalid restart interval in %s", fileName);
+}
+
+
+
 static void decompress(int inputFile, const char * fileName) {
     CompressedBinaryHeader header;
     while (readHeader(inputFile, &header, fileName)) {
+        if (!strcmp(GAP_CODED_SIGNATURE, header.signature)) {
+            GapCodedHeader gapHeader;
+            memcpy(&gapHeader, &header, sizeof(GapCodedHeader));
+            readGapCodedHeader(&gapHeader, fileName);
+
+            Prime from, to;
+            str_to_prime(from, gapHeader.from);
+            str_to_prime(to, gapHeader.to);
+            int outputFile = useStdout ? STDOUT_FILENO : openFileForPrime(from, to);
+            writeGapText(&gapHeader, inputFile, outputFile, fileName);
+            if (!useStdout) close(outputFile);
+            continue;
+        }
+
         Prime from, to;
         long long expectedTextSize = stringToLongLong(header.textSize);
         long long primesExpected = stringToLongLong(header.primeCount);
@@ -284,7 +459,8 @@ static void decompress(int inputFile, const char * fileName) {
         str_to_prime(to, header.to);
 
         int outputFile = useStdout ? STDOUT_FILENO : openFileForPrime(from, to);
-        writePrimeText(from, to, bufferSize, inputFile, outputFile, fileName, expectedTextSize, primesExpected);
+        int wheel = !strcmp(COMPRESSED_BINARY_SKIP_WHEEL, header.skip);
+        writePrimeText(from, to, bufferSize, wheel, inputFile, outputFile, fileName, expectedTextSize, primesExpected);
         if (!useStdout) close(outputFile);
     }
 }
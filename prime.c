@@ -17,43 +17,249 @@ for each time a prime is touched it uses addition and not division.
 
 */
 
+// For MAP_ANONYMOUS, MAP_HUGETLB, madvise(), pthread_setaffinity_np(), syscall(), splice() and vmsplice()
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <errno.h>
+#include <stdint.h>
 
 #include <pthread.h>
-#include <semaphore.h>
+#include <sched.h>
 #include <math.h>
+#include <dirent.h>
 
 // For memory mapping a file
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <sys/mman.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+// For --io-uring, without the kernel header every write falls back to write()
+#if defined(__linux__) && defined(__has_include)
+    #if __has_include(<linux/io_uring.h>)
+        #define HAVE_IO_URING
+        #include <linux/io_uring.h>
+        #include <sys/syscall.h>
+    #endif
+#endif
+
 #include "prime_shared.h"
 #include "shared.h"
 #include "output.h"
 
 //#define VERBOSE_DEBUG
 
-#define ALLOC_UNIT 0x100000
+#define INIT_SEGMENT_SIZE 0x100000
+
+#define INIT_FILE_ALLOC_UNIT 0x100000
 size_t APPLY_DEBUG_MASK; // This used to be a constant, but now we use a variable set in main
 #define SCAN_DEBUG_MASK 0x3FFFFF
 
 #define WRITE_BUFFER_SIZE 0x100000
 
+// With --io-uring each thread has this many write buffers in flight
+#define ASYNC_WRITE_BUFFERS 4
+
+// With --splice pipes are enlarged to this if allowed (the default limit for unprivileged processes)
+#define SPLICE_PIPE_SIZE 0x100000
+
+// How a SpliceWriter writes its file
+#define SPLICE_WRITE   0          // Neither a pipe nor a regular file, write() is used
+#define SPLICE_TO_PIPE 1
+#define SPLICE_TO_FILE 2
+
+// With --direct-io files are written in multiples of this from buffers aligned to it
+#define DIRECT_IO_ALIGNMENT 0x1000
+
+// With more than one thread text is formatted in parts of this many bitmap bytes, threads which have run out of
+// chunks format parts for those still writing.  Each thread may have TEXT_PARTS_AHEAD parts formatted ahead
+// of the one being written.
+#define TEXT_PART_SIZE 0x8000
+#define TEXT_PARTS_AHEAD 2
+
+// Output queued for the writer thread by each worker thread before it has to wait, see queueOutput()
+#define REORDER_BUFFER_SIZE 0x4000000
+
+#define BUCKET_ALLOC_UNIT 0x1000
+
+// With --huge-pages large tables are mapped in multiples of this
+#define HUGE_PAGE_SIZE 0x200000
+
+// Primes smaller than a segment are applied to the bitmap one segment at a time so that segment stays in cache
+#define SEGMENT_SIZE 0x40000
+
+// Primes below this use the unrolled crossing kernels
+#define KERNEL_PRIME_LIMIT (SEGMENT_SIZE / 16)
+
+// Pre-sieve patterns are limited to this size, short ones are repeated up to PRESIEVE_MIN_SIZE.
+// Low primes are no greater than LOW_PRIME_LIMIT (see prime_shared.h) so there are never more
+// than PRESIEVE_MAX_PATTERNS.
+#define PRESIEVE_PATTERN_SIZE 0x40000
+#define PRESIEVE_MIN_SIZE 0x2000
+#define PRESIEVE_MAX_PATTERNS 64
+
+// A sieving prime waiting in a bucket for the chunk its next multiple lands in
+typedef struct BucketEntry {
+    size_t offset;            // Offset of the next odd multiple from the chunk's boundary
+    size_t step;              // Twice the prime (the distance between odd multiples)
+} BucketEntry;
+
+typedef struct Bucket {
+    size_t count;
+    size_t allocated;
+    BucketEntry * entries;
+} Bucket;
+
+// Writes submitted through io_uring (see --io-uring) so formatting carries on while earlier buffers are written.
+// Seekable files are written at explicit offsets so several buffers may be in flight, anything else
+// (pipes or files opened for append) has one at a time to keep the output in order.
+typedef struct AsyncWriteBuffer {
+    char * data;
+    size_t size;
+    long long offset;         // Where in the file it is being written, -1 for the current position
+    int busy;
+} AsyncWriteBuffer;
+
+typedef struct AsyncWriter {
+    int ring;                 // The io_uring file descriptor, -1 if writes are not asynchronous
+    int file;                 // The file being written
+    long long offset;         // The offset of the next write, -1 if the file is not seekable
+    int inFlight;
+    AsyncWriteBuffer buffers[ASYNC_WRITE_BUFFERS];
+    void * sqRing;
+    size_t sqRingSize;
+    void * cqRing;
+    size_t cqRingSize;
+    void * sqes;
+    size_t sqesSize;
+    unsigned * sqTail;
+    unsigned * sqMask;
+    unsigned * sqArray;
+    unsigned * cqHead;
+    unsigned * cqTail;
+    unsigned * cqMask;
+    void * cqes;
+} AsyncWriter;
+
+// Output is formatted into these so it can be queued for the writer thread or spliced without being copied
+typedef struct OutputBuffer {
+    struct OutputBuffer * next;
+    size_t size;
+    size_t capacity;          // Buffers of WRITE_BUFFER_SIZE are kept for reuse, others are freed once written
+    size_t pipeMark;          // With --splice the pages spliced into the pipe up to the end of this buffer
+    char data[];
+} OutputBuffer;
+
+// Output spliced (see --splice) rather than written.  Pipes are given the buffers themselves with vmsplice().
+// A pipe holds no more than pipePages pages so once that many more have been spliced after a buffer,
+// the reader has taken it and the buffer can be used again.  Files are written by splicing through a pipe
+// of our own which is emptied each time.
+typedef struct SpliceWriter {
+    int file;                 // The file being written, -1 if none
+    int mode;                 // SPLICE_WRITE, SPLICE_TO_PIPE or SPLICE_TO_FILE
+    int through[2];           // The pipe used to splice to files
+    size_t pipePages;         // The capacity of the pipe in pages
+    size_t pagesSpliced;      // Pages spliced into the pipe since the file was started
+    OutputBuffer * inPipe;    // Spliced buffers the reader may not have taken yet, oldest first
+    OutputBuffer * lastInPipe;
+} SpliceWriter;
+
+// Output for a file opened with O_DIRECT (see --direct-io) is gathered into an aligned buffer and written a
+// whole buffer at a time.  Only the end of the file, which is rarely a whole block, goes through the page cache.
+typedef struct DirectWriter {
+    int file;                 // The file being written, -1 if none
+    unsigned char * buffer;   // WRITE_BUFFER_SIZE bytes aligned to DIRECT_IO_ALIGNMENT
+    size_t size;              // The bytes waiting in buffer
+} DirectWriter;
+
 // For threading
 typedef struct ThreadDescriptor {
     int threadNum;
     pthread_t threadHandle;
-    sem_t writeSemaphore;
-    sem_t * nextThreadWriteSemaphore;
+    pthread_mutex_t claimMutex;
+    size_t nextChunk;         // The next chunk of this thread's own (threadNum - 1 + n * threadCount)
+    size_t endChunk;          // The end of the thread's own chunks, moved back as other threads take them
+    size_t writeChunk;        // The chunk this thread is writing, see queueOutput()
+    size_t currentChunk;      // The chunk number currently being processed
+    size_t bucketCount;       // The number of buckets in the ring (0 if not using buckets)
+    Bucket * buckets;         // Ring of buckets, indexed by chunk number
+    size_t * primeOffsets;    // The next multiple of each segment or carried prime, relative to the start of the chunk
+    unsigned char * segmentWheelPositions; // The wheel position of each segment prime's next co-factor (wheel only)
+    size_t carriedChunk;      // The chunk primeOffsets have been carried forward to
+    unsigned char * bitmap;   // Reused for every chunk the thread processes, see getThreadBitmap()
+    size_t bitmapSize;
+    AsyncWriter asyncWriter;  // Used for this thread's output with --io-uring
+    SpliceWriter spliceWriter;  // Used for this thread's output with --splice
+    DirectWriter directWriter;  // Used for this thread's output with --direct-io
+    OutputBuffer * spareBuffers;  // Written buffers kept for getOutputBuffer()
+    const SievePrime * primes;                  // primes[] or this thread's NUMA node's copy of it
+    const struct PreSievePattern * preSievePatterns;  // The same for preSievePatterns[]
 } ThreadDescriptor;
 
 
 static ThreadDescriptor * threads;
+static size_t chunkTotal;                 // The number of chunks between startValue and endValue
+
+// With a single output file and more than one thread the output is written in chunk order by a writer thread.
+// Workers queue their output for it and go straight on to their next chunk.
+typedef struct ChunkOutput {
+    struct ChunkOutput * next;      // The next chunk waiting to be written, in chunk order
+    size_t chunkNum;
+    OutputBuffer * first;
+    OutputBuffer * last;
+    int finished;                   // Nothing more will be queued for this chunk
+} ChunkOutput;
+
+static int orderedOutput;
+static int preallocateFiles;              // Each chunk has a file of its own which can be allocated up front
+static pthread_t writerThread;
+static pthread_mutex_t outputMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t outputQueued = PTHREAD_COND_INITIALIZER;    // Wakes the writer thread
+static pthread_cond_t outputWritten = PTHREAD_COND_INITIALIZER;   // Wakes workers waiting for space
+static ChunkOutput * pendingChunks;
+static size_t nextWriteChunk;
+static size_t queuedBytes;
+static size_t queuedByteLimit;
+
+// A chunk's bitmap being written as text in parts, see writePrimeTextInParts()
+typedef struct TextJob {
+    struct TextJob * next;
+    Prime base;                     // The value of the first bit in the bitmap
+    Prime to;
+    const unsigned char * bitmap;
+    size_t range;
+    unsigned int skipped[3];        // Written at the start of the first part
+    int skippedCount;
+    size_t partCount;
+    size_t nextPart;                // The next part to be formatted
+    size_t writtenParts;            // Parts are not started more than partsAhead beyond this
+    size_t partsAhead;
+    OutputBuffer ** parts;          // Each part once it has been formatted
+} TextJob;
+
+static TextJob * textJobs;
+static int sievingThreads;                // Threads still processing chunks, the others help format text
+static pthread_mutex_t textMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t textPartsWaiting = PTHREAD_COND_INITIALIZER;    // Wakes threads helping with text
+static pthread_cond_t textPartFormatted = PTHREAD_COND_INITIALIZER;   // Wakes threads writing text
+
+// CPU affinity (see --affinity and --numa-replicate)
+typedef struct NodeReplica {
+    SievePrime * primes;
+    struct PreSievePattern * preSievePatterns;
+} NodeReplica;
+
+static int * threadCpus;                  // The cpu each thread is pinned to, NULL if threads are not pinned
+static int cpuNodes[CPU_SETSIZE];         // The NUMA node of each cpu
+static int nodeCount;
+static NodeReplica * nodeReplicas;        // Copies of primes[] and preSievePatterns[] for each node, made on first use
+static pthread_mutex_t replicaMutex = PTHREAD_MUTEX_INITIALIZER;
 
 
 
@@ -63,18 +269,43 @@ static void writePrimeText(Prime startValue, Prime endValue, size_t range, unsig
 static void writePrimeSystemBinary(Prime startValue, Prime endValue, size_t range, unsigned char * bitmap, int file );
 static void writePrimeCompressedBinary(Prime startValue, Prime endValue, size_t range, unsigned char * bitmap, int file );
 static void writePrimeStatsOnly(Prime startValue, Prime endValue, size_t range, unsigned char * bitmap, int file );
+static void writePrimeGapCoded(Prime startValue, Prime endValue, size_t range, unsigned char * bitmap, int file );
 
 static WritePrimeFunction writePrime = writePrimeText;
 
+static size_t countBits(const unsigned char * bitmap, size_t size);
+
 // The single file to write to (if single file is enabled);
 static int theSingleFile;
 
 
-// All primes less than or sqrt(endValue)
+// All odd primes less than or equal to sqrt(endValue)
 // Generating these is what initialisation is for
+// They are stored natively, needing half (prime-64) or a quarter (prime-gmp) of the space of a Prime.
 static size_t primeCount;                 // Number of primes stored
-static size_t primesAllocated;            // Number of primes the array can store
-static Prime * primes;                    // The array of primes
+static SievePrime * primes;               // The array of primes
+static size_t primesLargeSize;            // The size of primes[] if it came from allocateLarge(), otherwise 0
+static Prime maxSievingPrime;             // Every odd prime up to this is in primes[]
+
+// primes[] may be mapped straight from an init file (see -i) rather than allocated
+static void * initFileMap;
+static size_t initFileMapSize;
+
+// Self initialisation sieves 0 to sqrt(endValue) one segment at a time, spreading segments between the threads.
+// Each segment is counted first so the primes array can be allocated once and every segment then writes its
+// own part of it.
+typedef struct InitSegment {
+    size_t start;             // Byte offset of the segment in the bitmap
+    size_t size;              // Size of the segment in bytes
+    size_t firstPrime;        // Index in primes[] of the segment's first prime
+    size_t count;             // Number of primes in the segment
+} InitSegment;
+
+static unsigned char * initBitmap;        // Bitmap representing 0 to sqrt(endValue)
+static size_t * initBasePrimes;           // Odd primes up to sqrt(sqrt(endValue))
+static size_t initBasePrimeCount;
+static InitSegment * initSegments;
+static size_t initSegmentCount;
 
 // used if an odd start value has been requested
 static int disallow2 = 0;
@@ -83,10 +314,62 @@ static int disallow2 = 0;
 static unsigned char removeMask[] = {0xFF, 0xFE, 0xFF, 0xFD, 0xFF, 0xFB, 0xFF, 0xF7, 0xFF, 0xEF, 0xFF, 0xDF, 0xFF, 0xBF, 0xFF, 0x7F};
 static unsigned char checkMask[] =  {0x00, 0x01, 0x00, 0x02, 0x00, 0x04, 0x00, 0x08, 0x00, 0x10, 0x00, 0x20, 0x00, 0x40, 0x00, 0x80};
 
-static unsigned char * lowPrimeMap;
+// The layout of bitmaps passed to the writers, see output.h
+static int bitmapSpan = ODD_SPAN;
+static const unsigned char * bitmapResidues = oddResidues;
+
+// Maps used to operate on mod 30 wheel bitmaps (see --wheel).
+// Each co-factor on the wheel is followed by the next after a gap of wheelGaps[position].
+static unsigned char wheelRemoveMask[] = {0xFF, 0xFE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFD, 0xFF, 0xFF, 0xFF, 0xFB, 0xFF, 0xF7, 0xFF,
+                                          0xFF, 0xFF, 0xEF, 0xFF, 0xDF, 0xFF, 0xFF, 0xFF, 0xBF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x7F};
+static unsigned char wheelGaps[] = {6, 4, 2, 4, 2, 4, 6, 2};
+static unsigned char wheelAdvance[] = {1, 0, 5, 4, 3, 2, 1, 0, 3, 2, 1, 0, 1, 0, 3, 2, 1, 0, 1, 0, 3, 2, 1, 0, 5, 4, 3, 2, 1, 0};
+static unsigned char wheelAdvancePosition[] = {0, 0, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 4, 4, 4, 4, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7, 7, 7};
+
+// The number represented by bit 0 of a bitmap, less its residue.
+// process() always starts bitmaps on an even number, the wheel needs a multiple of 30.
+#define getBitmapBase(base, from) {\
+    prime_cp(base, from);\
+    if (useWheel) {\
+        Prime baseOffset;\
+        prime_mod_num(baseOffset, from, WHEEL_SPAN);\
+        prime_sub_prime(base, base, baseOffset);\
+    }\
+}
+
+// Bucket sieve
+// Primes at or above the bucket threshold hit a chunk at most once, so rather than working out where each one lands
+// in every chunk, each thread files them by the next of its own chunks they land in.
+static size_t bucketPrimeStart;           // First prime in primes[] to be handled by buckets
+static size_t bucketPrimeEnd;             // First prime after bucketPrimeStart which is not handled by buckets
+static size_t bucketChunkSpan;            // chunkSize as a native number
+static size_t bucketChunkTotal;           // The number of chunks between startValue and endValue
+static Prime chunkOrigin;                 // startValue rounded down to a multiple of chunkSize
+
+// Primes from lowPrimeCount up to segmentPrimeEnd are applied segment by segment
+// and those below kernelPrimeEnd use the crossing kernels (odd bitmaps only)
+static size_t segmentPrimeEnd;
+static size_t kernelPrimeEnd;
+
+// Primes from lowPrimeCount up to carryPrimeEnd keep their offsets from one of a thread's chunks to the next.
+// Moving on from one chunk to the thread's next skips (threadCount - 1) * chunkSize numbers, carryStepMods
+// holds this modulo twice each prime.
+#define CARRY_UNKNOWN (SIZE_MAX / 2)
+static size_t carryPrimeEnd;
+static size_t * carryStepMods;
+
+// Low primes are removed from each segment before sieving by combining periodic patterns.
+// Each pattern holds a group of low primes, keeping it small enough to stay in the cache.
+typedef struct PreSievePattern {
+    size_t period;            // The product of the pattern's primes, the pattern repeats every period bytes
+    size_t size;              // The size of map, a whole number of periods
+    size_t multiplyer;        // Converts a bitmap start into a byte offset (odd bitmaps only)
+    unsigned char * map;
+} PreSievePattern;
+
 static size_t lowPrimeCount;
-static Prime lowPrimeMapSize;
-static Prime lowPrimeMapMultiplyer;
+static PreSievePattern preSievePatterns[PRESIEVE_MAX_PATTERNS];
+static int preSievePatternCount;
 static int lowPrimeModLookup[] = {0,15,0,5,0,3,0,9,0,7,0,13,0,11,0,1};
 
 static int  bitCount[] =            {0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,
@@ -98,114 +381,429 @@ static int  bitCount[] =            {0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,1,2,2,3,2,3
                                      2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,
                                      3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,4,5,5,6,5,6,6,7,5,6,6,7,6,7,7,8};
 
-static void applyPrime(Prime prime, Prime offset, unsigned char * map, size_t mapSize) {
-    // A further optimization can be made here by splitting this function into two.
-    // One which starts at prime^2 and one which starts at the beginning
-    // process() would be able to determine when to use the two through 
-    // binary search.
+// How each allocateLarge() was backed, reported by reportHugePages()
+static size_t hugeTlbAllocations;
+static size_t transparentHugeAllocations;
+static size_t smallPageAllocations;
+
+
+
+// Allocates the chunk bitmaps, pre-sieve patterns and primes[].
+// With --huge-pages these are mapped on 2MB pages (MAP_HUGETLB) to save TLB misses while crossing.
+// If no huge pages are reserved the mapping is aligned to 2MB and transparent huge pages are requested instead.
+// populate faults every page in now rather than when it is first written.
+static void * allocateLarge(size_t bytes, int populate) {
+    if (!useHugePages) {
+        void * result = mallocSafe(bytes);
+        if (populate) memset(result, 0, bytes);
+        return result;
+    }
+
+    size_t size = (bytes + HUGE_PAGE_SIZE - 1) & ~((size_t) HUGE_PAGE_SIZE - 1);
+    void * result = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (populate ? MAP_POPULATE : 0), -1, 0);
+    if (result != MAP_FAILED) {
+        __atomic_add_fetch(&hugeTlbAllocations, 1, __ATOMIC_RELAXED);
+        return result;
+    }
+
+    // Map an extra huge page then trim both ends back to a 2MB boundary
+    unsigned char * map = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) exitError(255, errno, "Could not allocate to %zd bytes", bytes);
+    unsigned char * aligned = (unsigned char *) (((uintptr_t) map + HUGE_PAGE_SIZE - 1) & ~((uintptr_t) HUGE_PAGE_SIZE - 1));
+    if (aligned > map) munmap(map, aligned - map);
+    munmap(aligned + size, map + HUGE_PAGE_SIZE - aligned);
+
+    if (madvise(aligned, size, MADV_HUGEPAGE)) __atomic_add_fetch(&smallPageAllocations, 1, __ATOMIC_RELAXED);
+    else __atomic_add_fetch(&transparentHugeAllocations, 1, __ATOMIC_RELAXED);
+
+    // MAP_POPULATE would fault the pages in before madvise() so they would not be huge
+    if (populate) memset(aligned, 0, size);
+    return aligned;
+}
+
+
+
+static void freeLarge(void * memory, size_t bytes) {
+    if (!useHugePages) {
+        free(memory);
+        return;
+    }
+    munmap(memory, (bytes + HUGE_PAGE_SIZE - 1) & ~((size_t) HUGE_PAGE_SIZE - 1));
+}
+
+
+
+static void reportHugePages() {
+    if (!useHugePages || silent) return;
+    stdLog("Huge pages: %zd allocations used reserved huge pages, %zd requested transparent huge pages, %zd used normal pages",
+            hugeTlbAllocations, transparentHugeAllocations, smallPageAllocations);
+
+    // Transparent huge pages are only a request, the kernel may be set never to give them
+    if (transparentHugeAllocations) {
+        char setting[64] = "";
+        FILE * file = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+        if (file) {
+            if (!fgets(setting, sizeof(setting), file)) setting[0] = '\0';
+            fclose(file);
+        }
+        if (strstr(setting, "[never]")) stdLog("Transparent huge pages are disabled on this system");
+    }
+}
+
+// Removes odd multiples of prime from map starting at value (relative to the start of the map).
+// Only the start is checked as a Prime, once inside the map every offset is native.
+static void crossPrimeMultiples(Prime prime, Prime value, unsigned char * map, size_t mapSize) {
+    size_t limit = mapSize * 16;
+    Prime primeLimit;
+    prime_set_num(primeLimit, limit);
+    if (!prime_lt(value, primeLimit)) return;
+    size_t offset = prime_get_num(value);
+
+    prime_set_num(primeLimit, SIZE_MAX / 4);
+    if (prime_gt(prime, primeLimit)) {
+        // Too big to step through natively, but then it can't hit the map twice
+        map[offset >> 4] &= removeMask[offset & 0x0F];
+        return;
+    }
+    size_t stepSize = prime_get_num(prime) * 2;
+    for (; offset < limit; offset += stepSize) {
+        map[offset >> 4] &= removeMask[offset & 0x0F];
+    }
+}
+
+
+
+// For primes where prime^2 >= offset, so the first multiple to remove is prime^2 itself and no division is needed.
+static void applyPrimeFromSquare(Prime prime, Prime offset, unsigned char * map, size_t mapSize) {
+    Prime value;
+    // value = (prime ^ 2) - offset;
+    prime_mul_prime(value, prime, prime);
+    prime_sub_prime(value, value, offset);
+    crossPrimeMultiples(prime, value, map, mapSize);
+}
+
 
+
+static void applyPrime(Prime prime, Prime offset, unsigned char * map, size_t mapSize) {
     Prime value;
     prime_mul_prime(value, prime, prime);
-    // prime_sub_prime(value, prime, offset);
+    if (!prime_lt(value, offset)) {
+        applyPrimeFromSquare(prime, offset, map, mapSize);
+        return;
+    }
 
     // This function subtracts the offset from the prime rather than adding it to the map
     // It's okay. This works.
-    if (prime_lt(value, offset)) {
-        // value = prime - ((offset - 1) % prime) - 1;
-        prime_sub_num(value, offset, 1);
+    // value = prime - ((offset - 1) % prime) - 1;
+    prime_sub_num(value, offset, 1);
+    prime_mod_prime(value, value, prime);
+    prime_sub_prime(value, prime, value);
+    prime_sub_num(value, value, 1);
+    if (!prime_is_odd(value)) prime_add_prime(value, value, prime);
+    crossPrimeMultiples(prime, value, map, mapSize);
+}
+
+
+
+// Crossing kernels for primes which hit a segment many times.
+// Odd multiples of a prime step through every bit of a byte once every 8 steps, so once a multiple lands on
+// bit 0 the next 8 land at fixed byte offsets and bits which depend only on the prime's residue mod 16.
+// For prime = 16q + r the k-th step lands on 1 + 2rk past the first, being byte 2qk + ((1 + 2rk) >> 4).
+#define crossKernelStep(r, k) \
+    byte[(k) * doubleQ + ((1 + 2 * (r) * (k)) >> 4)] &= (unsigned char) ~(1 << ((((1 + 2 * (r) * (k)) & 0x0F) - 1) / 2))
+
+#define crossKernel(r) \
+static size_t crossKernel##r(unsigned char * bitmap, size_t value, size_t prime, size_t limit) {\
+    size_t stepSize = prime * 2;\
+    while (value < limit && (value & 0x0F) != 1) {\
+        bitmap[value >> 4] &= removeMask[value & 0x0F];\
+        value += stepSize;\
+    }\
+    size_t doubleQ = (prime >> 4) * 2;\
+    while (value + 14 * prime < limit) {\
+        unsigned char * byte = bitmap + (value >> 4);\
+        crossKernelStep(r, 0);\
+        crossKernelStep(r, 1);\
+        crossKernelStep(r, 2);\
+        crossKernelStep(r, 3);\
+        crossKernelStep(r, 4);\
+        crossKernelStep(r, 5);\
+        crossKernelStep(r, 6);\
+        crossKernelStep(r, 7);\
+        value += 16 * prime;\
+    }\
+    while (value < limit) {\
+        bitmap[value >> 4] &= removeMask[value & 0x0F];\
+        value += stepSize;\
+    }\
+    return value;\
+}
+
+crossKernel(1)
+crossKernel(3)
+crossKernel(5)
+crossKernel(7)
+crossKernel(9)
+crossKernel(11)
+crossKernel(13)
+crossKernel(15)
+
+// Removes odd multiples of prime from bitmap starting at offset value, up to limit.  Returns the next offset.
+typedef size_t (*CrossKernelFunction)(unsigned char * bitmap, size_t value, size_t prime, size_t limit);
+static CrossKernelFunction crossKernels[] = {
+    NULL, crossKernel1, NULL, crossKernel3, NULL, crossKernel5, NULL, crossKernel7,
+    NULL, crossKernel9, NULL, crossKernel11, NULL, crossKernel13, NULL, crossKernel15
+};
+
+
+
+// Returns the offset from "from" of the first odd multiple of prime which needs removing (never below prime^2)
+// or limit if this lies at or beyond limit.
+static size_t firstMultipleOffset(Prime prime, Prime from, size_t limit) {
+    Prime value;
+    prime_mul_prime(value, prime, prime);
+    if (prime_lt(value, from)) {
+        // value = prime - ((from - 1) % prime) - 1;
+        prime_sub_num(value, from, 1);
         prime_mod_prime(value, value, prime);
         prime_sub_prime(value, prime, value);
         prime_sub_num(value, value, 1);
         if (!prime_is_odd(value)) prime_add_prime(value, value, prime);
     }
-    else  {
-        // value = (prime ^ 2) - offset;
-        prime_sub_prime(value, value, offset);
+    else {
+        prime_sub_prime(value, value, from);
     }
-    Prime stepSize;
-    prime_mul_num(stepSize, prime, 2);
+    Prime primeLimit;
+    prime_set_num(primeLimit, limit);
+    if (prime_ge(value, primeLimit)) return limit;
+    return prime_get_num(value);
+}
 
-    Prime applyTo;
-    prime_set_num(applyTo, mapSize);
-    prime_mul_16(applyTo, applyTo);
-    while (prime_lt(value,applyTo)) {
-        Prime tmp;
-        prime_div_16(tmp, value);
-        map[prime_get_num(tmp)] &= removeMask[prime_get_num(value) & 0x0F];
-        prime_add_prime(value, value, stepSize);
+
+
+// Returns the offset from base of the first multiple of prime which needs removing from a wheel bitmap (never
+// below prime^2) or limit if this lies at or beyond limit.  The wheel position of its co-factor is put in wheelPosition.
+static size_t firstWheelMultipleOffset(Prime prime, Prime base, size_t limit, unsigned char * wheelPosition) {
+    Prime start;
+    prime_mul_prime(start, prime, prime);
+    if (prime_lt(start, base)) prime_cp(start, base);
+
+    // coFactor = ceil(start / prime) moved on to the next number co-prime to 30
+    Prime coFactor, tmp;
+    prime_add_prime(coFactor, start, prime);
+    prime_sub_num(coFactor, coFactor, 1);
+    prime_div_prime(coFactor, coFactor, prime);
+    prime_mod_num(tmp, coFactor, WHEEL_SPAN);
+    size_t residue = prime_get_num(tmp);
+    prime_add_num(coFactor, coFactor, wheelAdvance[residue]);
+    *wheelPosition = wheelAdvancePosition[residue];
+
+    prime_mul_prime(tmp, coFactor, prime);
+    prime_sub_prime(tmp, tmp, base);
+    Prime primeLimit;
+    prime_set_num(primeLimit, limit);
+    if (prime_ge(tmp, primeLimit)) return limit;
+    return prime_get_num(tmp);
+}
+
+
+
+// Removes multiples of prime from a wheel bitmap starting at offset value, up to limit.
+// Returns the offset of the next multiple and updates the wheel position of its co-factor.
+static size_t crossWheelMultiples(unsigned char * map, size_t prime, size_t value, unsigned char * wheelPosition, size_t limit) {
+    unsigned char position = *wheelPosition;
+    while (value < limit) {
+        map[value / WHEEL_SPAN] &= wheelRemoveMask[value % WHEEL_SPAN];
+        value += prime * wheelGaps[position];
+        position = (position + 1) & 7;
     }
+    *wheelPosition = position;
+    return value;
 }
 
 
 
-static void addPrime(Prime value) {
-    if (primeCount == primesAllocated) {
-        if (verbose) {
-            PrimeString valueString;
-            prime_to_str(valueString, value);
-            stdLog("Initialized %zd primes, reached value %s (ex)", primeCount, valueString);
-        }
-        primesAllocated += ALLOC_UNIT;
-        primes = reallocSafe(primes, primesAllocated * sizeof(Prime));
+static void applyWheelPrime(Prime prime, Prime base, unsigned char * map, size_t mapSize) {
+    size_t limit = mapSize * WHEEL_SPAN;
+    unsigned char wheelPosition;
+    size_t value = firstWheelMultipleOffset(prime, base, limit, &wheelPosition);
+    if (value >= limit) return;
+
+    Prime stepLimit;
+    prime_set_num(stepLimit, SIZE_MAX / 8);
+    if (prime_gt(prime, stepLimit)) {
+        // Too big to step through natively, but then it can't hit the map twice
+        map[value / WHEEL_SPAN] &= wheelRemoveMask[value % WHEEL_SPAN];
+        return;
     }
-    prime_cp(primes[primeCount], value);
-    ++primeCount;
+    crossWheelMultiples(map, prime_get_num(prime), value, &wheelPosition, limit);
 }
 
 
 
-static void populateLowPrimeMap() {
-    prime_set_num(lowPrimeMapSize, 1);
-    lowPrimeCount = 0;
-    while (prime_le(primes[lowPrimeCount], lowPrimeMax)) {
-        prime_mul_prime(lowPrimeMapSize, lowPrimeMapSize, primes[lowPrimeCount]);
-        ++lowPrimeCount;
+// Builds a pre-sieve pattern from the low primes firstPrime (inc) to endPrime (ex)
+static void buildPattern(PreSievePattern * pattern, size_t firstPrime, size_t endPrime, size_t period) {
+    // Short patterns are repeated so that each copy into a bitmap moves a worthwhile amount
+    pattern->period = period;
+    pattern->size = period * ((PRESIEVE_MIN_SIZE + period - 1) / period);
+    pattern->map = allocateLarge(pattern->size, 0);
+    memset(pattern->map, 0xFF, pattern->size);
+
+    // The pattern starts at 0 so every multiple is removed, including the prime itself
+    for (size_t i = firstPrime; i < endPrime; ++i) {
+        size_t prime = primes[i];
+        if (useWheel) {
+            unsigned char wheelPosition = 0;
+            crossWheelMultiples(pattern->map, prime, prime, &wheelPosition, pattern->size * WHEEL_SPAN);
+        }
+        else {
+            for (size_t value = prime; value < pattern->size * 16; value += prime * 2) {
+                pattern->map[value >> 4] &= removeMask[value & 0x0F];
+            }
+        }
     }
 
-    if (!lowPrimeCount) return;
+    // 16 * multiplyer = 1 (mod period)
+    pattern->multiplyer = ((period * lowPrimeModLookup[period % 16] + 1) / 16) % period;
+}
 
-    lowPrimeMap = mallocSafe(prime_get_num(lowPrimeMapSize));
-    memset(lowPrimeMap, 0xFF, prime_get_num(lowPrimeMapSize));
 
-    Prime offset;
-    prime_mul_num(offset,lowPrimeMapSize,4);
 
-    for (int i=0; i < lowPrimeCount; ++i) {
-        // we dont put 0 into arg 2 to be sure of clearing 0 bit
-        applyPrime(primes[i], offset, lowPrimeMap, prime_get_num(lowPrimeMapSize));
+static void populateLowPrimeMap() {
+    // 3 and 5 are already removed by the wheel itself
+    size_t firstLowPrime = useWheel ? 2 : 0;
+    lowPrimeCount = firstLowPrime;
+    Prime prime;
+    while (lowPrimeCount < primeCount) {
+        prime_set_num(prime, primes[lowPrimeCount]);
+        if (prime_gt(prime, lowPrimeMax)) break;
+        ++lowPrimeCount;
     }
-    
-    prime_mod_num(lowPrimeMapMultiplyer, lowPrimeMapSize, 16);
-    prime_mul_num(lowPrimeMapMultiplyer, lowPrimeMapSize, lowPrimeModLookup[prime_get_num(lowPrimeMapMultiplyer)]);
-    prime_add_num(lowPrimeMapMultiplyer, lowPrimeMapMultiplyer, 1);
-    prime_div_num(lowPrimeMapMultiplyer, lowPrimeMapMultiplyer, 16);
-    prime_mod_prime(lowPrimeMapMultiplyer, lowPrimeMapMultiplyer, lowPrimeMapSize);
+
+    // Consecutive low primes are grouped together while their pattern stays small
+    preSievePatternCount = 0;
+    for (size_t i = firstLowPrime; i < lowPrimeCount;) {
+        size_t period = primes[i];
+        size_t end = i + 1;
+        while (end < lowPrimeCount && period * primes[end] <= PRESIEVE_PATTERN_SIZE) {
+            period *= primes[end];
+            ++end;
+        }
+        buildPattern(preSievePatterns + preSievePatternCount, i, end, period);
+        ++preSievePatternCount;
+        i = end;
+    }
+
     if (verbose) {
-        if (lowPrimeCount > 0) {
-            PrimeString maxLowPrime;
-            prime_to_str(maxLowPrime, primes[lowPrimeCount-1]);
-            stdLog("Using %zd low primes - max %s", lowPrimeCount, maxLowPrime);
-            stdLog("lowPrimeMapSize: %zd",(size_t) prime_get_num(lowPrimeMapSize));
-            /*char bString[9];
-            bString[8] = 0;
-            for (int i = 0; i < prime_get_num(lowPrimeMapSize); ++i) {
-                for (int j = 0; j < 8; ++j) {
-                    bString[j] = ((lowPrimeMap[i] & (1 << j)) ? '1' : '0' );
-                }
-                stdLog("%s", bString);
-            }*/
+        if (preSievePatternCount) {
+            stdLog("Using %zd low primes - max %zd", lowPrimeCount - firstLowPrime, (size_t) primes[lowPrimeCount-1]);
+            for (int i = 0; i < preSievePatternCount; ++i) {
+                stdLog("Pre-sieve pattern %d: period %zd size %zd", i, preSievePatterns[i].period, preSievePatterns[i].size);
+            }
         }
         else {
           stdLog("No low primes used");
         }
-        PrimeString s;
-        prime_to_str(s, lowPrimeMapMultiplyer);
-        stdLog("lowPrimeMapMultiplyer: %s", s);
     }
 }
 
 
 
+// Sieves one segment of the self initialisation and counts its primes
+static void sieveInitSegment(InitSegment * segment) {
+    unsigned char * bitmap = initBitmap + segment->start;
+    size_t segmentStart = segment->start * 16;
+    size_t segmentBits = segment->size * 16;
+    memset(bitmap, 0xFF, segment->size);
+    for (size_t i = 0; i < initBasePrimeCount; ++i) {
+        size_t prime = initBasePrimes[i];
+        size_t value = prime * prime;
+        if (value < segmentStart) {
+            value = segmentStart + (prime - segmentStart % prime) % prime;
+            if (!(value & 1)) value += prime;
+        }
+        size_t stepSize = prime * 2;
+        for (value -= segmentStart; value < segmentBits; value += stepSize) {
+            bitmap[value >> 4] &= removeMask[value & 0x0F];
+        }
+    }
+    // 1 is not a prime
+    if (segment->start == 0) bitmap[0] &= 0xFE;
+    segment->count = countBits(bitmap, segment->size);
+}
+
+
+
+// Writes the primes found by sieveInitSegment() to their place in primes[]
+static void storeInitSegment(InitSegment * segment) {
+    const unsigned char * bitmap = initBitmap + segment->start;
+    size_t segmentStart = segment->start * 16;
+    SievePrime * target = primes + segment->firstPrime;
+    unsigned short bits[BITMAP_BLOCK_SIZE * 8];
+    for (size_t blockStart = 0; blockStart < segment->size; blockStart += BITMAP_BLOCK_SIZE) {
+        size_t blockSize = segment->size - blockStart;
+        if (blockSize > BITMAP_BLOCK_SIZE) blockSize = BITMAP_BLOCK_SIZE;
+        size_t count = getBitmapBits(bitmap + blockStart, blockSize, bits);
+        for (size_t i = 0; i < count; ++i) {
+            *(target++) = segmentStart + (blockStart + (bits[i] >> 3)) * 16 + oddResidues[bits[i] & 7];
+        }
+    }
+}
+
+
+
+static void * sieveInitSegments(void * threadPt) {
+    ThreadDescriptor * thread = (ThreadDescriptor*) threadPt;
+    pthread_setspecific(threadNumKey, &thread->threadNum);
+    for (size_t i = thread->threadNum - 1; i < initSegmentCount; i += threadCount) {
+        if (verbose) stdLog("Initialising segment %zd of %zd", i + 1, initSegmentCount);
+        sieveInitSegment(initSegments + i);
+    }
+    return NULL;
+}
+
+
+
+static void * storeInitSegments(void * threadPt) {
+    ThreadDescriptor * thread = (ThreadDescriptor*) threadPt;
+    pthread_setspecific(threadNumKey, &thread->threadNum);
+    for (size_t i = thread->threadNum - 1; i < initSegmentCount; i += threadCount) {
+        storeInitSegment(initSegments + i);
+    }
+    return NULL;
+}
+
+
+
+// Runs function on every thread, the calling thread acting as thread 1
+static void runInitThreads(void * (* function)(void *)) {
+    ThreadDescriptor * initThreads = mallocSafe(sizeof(ThreadDescriptor) * threadCount);
+    for (int threadNum = 1; threadNum < threadCount; ++threadNum) {
+        initThreads[threadNum].threadNum = threadNum + 1;
+        pthread_create(&(initThreads[threadNum].threadHandle), NULL, function, &(initThreads[threadNum]));
+    }
+    initThreads[0].threadNum = 1;
+    function(&(initThreads[0]));
+    for (int threadNum = 1; threadNum < threadCount; ++threadNum) {
+        pthread_join(initThreads[threadNum].threadHandle, NULL);
+    }
+    pthread_setspecific(threadNumKey, NULL);
+    free(initThreads);
+}
+
+
+
+// Every prime up to sqrt(endValue) is needed, but always those below 16 which the pre-sieve and wheel expect
+static void setMaxSievingPrime() {
+    prime_sqrt(maxSievingPrime, endValue);
+    Prime minRequired;
+    prime_set_num(minRequired, 15);
+    if (prime_lt(maxSievingPrime, minRequired)) prime_cp(maxSievingPrime, minRequired);
+}
+
+
+
 static void initializeSelf() {
     if (!silent) {
         PrimeString startValueString;
@@ -216,407 +814,2028 @@ static void initializeSelf() {
             startValueString, endValueString);
     }
 
-    // Allocate a bitmap to represent 0 to sqrt(endValue)
-    primesAllocated = ALLOC_UNIT;
-    primes = mallocSafe(primesAllocated * sizeof(Prime));
     Prime maxRequired;
-    prime_sqrt(maxRequired, endValue);
+    prime_cp(maxRequired, maxSievingPrime);
     if (verbose) {
         PrimeString maxRequiredString;
         prime_to_str(maxRequiredString, maxRequired);
         stdLog("Initialisation will produce every prime up to %s", maxRequiredString);
     }
-    Prime pRange;
-    prime_add_num(pRange, maxRequired, 15);
-    prime_div_16(pRange, pRange);
-    size_t range = prime_get_num(pRange);
+    size_t maxPrime = prime_get_num(maxRequired);
+    size_t range = maxPrime / 16 + 1;
     if (verbose) stdLog("Bitmap will contain %zd bytes", range);
-    unsigned char * bitmap = mallocSafe(range * sizeof(unsigned char));
-    memset(bitmap, 0xFF, range);
-    
-    // Evaluate all primes up to sqrt(sqrt(endValue))
-    // Each prime found here needs to be applied to the map
-    Prime zero;
-    prime_set_num(zero, 0);
+
+    // Evaluate all primes up to sqrt(sqrt(endValue)) in one go, these are applied to every segment
     prime_sqrt(maxRequired, maxRequired);
-    prime_add_num(pRange, maxRequired, 15);
-    prime_div_16(pRange, pRange);
-    size_t endRange = prime_get_num(pRange);
-    // The first byte is tricky so we hard code primes less than 16
-    // We never represent 2 as prime (we never use even numbers)
-    prime_set_num(primes[0], 3);
-    applyPrime(primes[0], zero, bitmap, range);
-    prime_set_num(primes[1], 5);
-    applyPrime(primes[1], zero, bitmap, range);
-    prime_set_num(primes[2], 7);
-    applyPrime(primes[2], zero, bitmap, range);
-    prime_set_num(primes[3], 11);
-    applyPrime(primes[3], zero, bitmap, range);
-    prime_set_num(primes[4], 13);
-    applyPrime(primes[4], zero, bitmap, range);
-    primeCount = 5;
-    size_t i = 1;
-    while (i <= endRange) {
-        if (verbose && !(i & SCAN_DEBUG_MASK)) 
-            stdLog("Writing primes as text %02.2f%%", 100 * ((double) i)/((double) range));
-        
-        if (bitmap[i]) {
-            for (int j = 1; j < 16; j+=2) {
-                if (bitmap[i] & checkMask[j]) {
-                    Prime value;
-                    getPrimeFromMap(value, zero, i, j);
-                    applyPrime(value, zero, bitmap, range);
-                    addPrime(value);
-                }
-            }
+    size_t baseMax = prime_get_num(maxRequired);
+    unsigned char * composite = mallocSafe(baseMax + 1);
+    memset(composite, 0, baseMax + 1);
+    initBasePrimes = mallocSafe((baseMax / 2 + 1) * sizeof(size_t));
+    initBasePrimeCount = 0;
+    for (size_t i = 3; i <= baseMax; i += 2) {
+        if (composite[i]) continue;
+        initBasePrimes[initBasePrimeCount++] = i;
+        for (size_t j = i * i; j <= baseMax; j += i * 2) composite[j] = 1;
+    }
+    free(composite);
+
+    // The bitmap is split into segments, sieved by every thread
+    initBitmap = mallocSafe(range);
+    initSegmentCount = (range + INIT_SEGMENT_SIZE - 1) / INIT_SEGMENT_SIZE;
+    initSegments = mallocSafe(initSegmentCount * sizeof(InitSegment));
+    for (size_t i = 0; i < initSegmentCount; ++i) {
+        initSegments[i].start = i * INIT_SEGMENT_SIZE;
+        initSegments[i].size = range - initSegments[i].start;
+        if (initSegments[i].size > INIT_SEGMENT_SIZE) initSegments[i].size = INIT_SEGMENT_SIZE;
+    }
+    runInitThreads(sieveInitSegments);
+
+    // Anything in the last byte beyond maxPrime is not needed
+    unsigned char * lastByte = initBitmap + range - 1;
+    initSegments[initSegmentCount - 1].count -= countBits(lastByte, 1);
+    *lastByte &= (1 << ((maxPrime % 16 + 1) / 2)) - 1;
+    initSegments[initSegmentCount - 1].count += countBits(lastByte, 1);
+
+    // Then each segment's primes are stored in order
+    primeCount = 0;
+    for (size_t i = 0; i < initSegmentCount; ++i) {
+        initSegments[i].firstPrime = primeCount;
+        primeCount += initSegments[i].count;
+    }
+    primesLargeSize = (primeCount + 1) * sizeof(SievePrime);
+    primes = allocateLarge(primesLargeSize, 0);
+    runInitThreads(storeInitSegments);
+
+    free(initSegments);
+    free(initBasePrimes);
+    free(initBitmap);
+
+    if (!silent) stdLog("Prime array now full with %zd primes", primeCount);
+}
+
+
+
+static void finalSelf() {
+    if (initFileMap) munmap(initFileMap, initFileMapSize);
+    else if (primesLargeSize) freeLarge(primes, primesLargeSize);
+    else free(primes);
+    free(carryStepMods);
+    for (int i = 0; i < preSievePatternCount; ++i) freeLarge(preSievePatterns[i].map, preSievePatterns[i].size);
+    if (nodeReplicas) {
+        for (int node = 0; node < nodeCount; ++node) {
+            NodeReplica * replica = nodeReplicas + node;
+            if (!replica->primes) continue;
+            freeLarge(replica->primes, (primeCount + 1) * sizeof(SievePrime));
+            for (int i = 0; i < preSievePatternCount; ++i) 
+                freeLarge(replica->preSievePatterns[i].map, replica->preSievePatterns[i].size);
+            free(replica->preSievePatterns);
         }
-        ++i;
-    }
-
-    // Evaluate all primes from sqrt(sqrt(endValue)) up to sqrt(endValue)
-    // Primes here do not need to be applied to the map
-    while (i < range) {
-        if (verbose && !(i & SCAN_DEBUG_MASK))
-            stdLog("Writing primes %02.2f%%", 100 * ((double) i)/((double) range));
-        
-        if (bitmap[i]) {
-            for (int j = 1; j < 16; j+=2) {
-                if (bitmap[i] & checkMask[j]) {
-                    Prime value;
-                    getPrimeFromMap(value, zero, i, j);
-                    addPrime(value);
-                }
+        free(nodeReplicas);
+    }
+    free(threadCpus);
+}
+
+
+
+// Find the index of the first prime in primes[] which is greater or equal to value
+static size_t findPrimeIndex(Prime value) {
+    size_t low = 0;
+    size_t high = primeCount;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        Prime prime;
+        prime_set_num(prime, primes[middle]);
+        if (prime_lt(prime, value)) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+
+
+// Find the index of the first prime in primes[] whose square is greater or equal to value.
+// No prime from here on has a multiple below value which needs removing.
+static size_t findSquareIndex(Prime value) {
+    size_t low = 0;
+    size_t high = primeCount;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        Prime prime, square;
+        prime_set_num(prime, primes[middle]);
+        prime_mul_prime(square, prime, prime);
+        if (prime_lt(square, value)) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+
+
+static void setupBuckets() {
+    bucketPrimeStart = primeCount;
+    bucketPrimeEnd = primeCount;
+
+    Prime tmp;
+    prime_mod_prime(tmp, startValue, chunkSize);
+    prime_sub_prime(chunkOrigin, startValue, tmp);
+
+    // Buckets hold a step of twice the prime which the wheel doesn't use
+    if (useWheel) return;
+
+    // Bucket offsets are native numbers so the chunk size must fit with plenty of room to spare.
+    // Chunk boundaries must also be even, just like the start of a bitmap.
+    Prime limit;
+    prime_set_num(limit, SIZE_MAX / 4);
+    if (prime_is_odd(chunkSize) || prime_gt(chunkSize, limit)) {
+        if (verbose) stdLog("Bucket sieve can not be used with this chunk size");
+        return;
+    }
+    bucketChunkSpan = prime_get_num(chunkSize);
+
+    // bucketChunkTotal = (endValue - chunkOrigin + chunkSize - 1) / chunkSize
+    prime_sub_prime(tmp, endValue, chunkOrigin);
+    prime_add_num(tmp, tmp, bucketChunkSpan - 1);
+    prime_div_prime(tmp, tmp, chunkSize);
+    if (prime_gt(tmp, limit)) return;
+    bucketChunkTotal = prime_get_num(tmp);
+
+    // Buckets are only useful if a thread has more than one chunk to carry primes between
+    if (bucketChunkTotal <= threadCount) return;
+
+    // Each thread only sees one chunk in every threadCount so a prime is only filed if
+    // it hits that thread's chunks less than once per chunk.
+    Prime threshold;
+    prime_mul_num(threshold, chunkSize, threadCount);
+    prime_div_num(threshold, threshold, 2);
+    if (prime_lt(threshold, chunkSize)) prime_cp(threshold, chunkSize);
+    bucketPrimeStart = findPrimeIndex(threshold);
+    if (bucketPrimeStart < lowPrimeCount) bucketPrimeStart = lowPrimeCount;
+
+    // offset + 2 * prime must also fit in a native number
+    prime_set_num(limit, (SIZE_MAX - bucketChunkSpan) / 2);
+    prime_add_num(limit, limit, 1);
+    bucketPrimeEnd = findPrimeIndex(limit);
+    if (bucketPrimeEnd < bucketPrimeStart) bucketPrimeEnd = bucketPrimeStart;
+
+    if (verbose) stdLog("Using bucket sieve for %zd of %zd primes", bucketPrimeEnd - bucketPrimeStart, primeCount);
+}
+
+
+
+static void setupSegments() {
+    Prime segmentSpan;
+    prime_set_num(segmentSpan, SEGMENT_SIZE * bitmapSpan);
+    segmentPrimeEnd = findPrimeIndex(segmentSpan);
+    if (segmentPrimeEnd < lowPrimeCount) segmentPrimeEnd = lowPrimeCount;
+    if (segmentPrimeEnd > bucketPrimeStart) segmentPrimeEnd = bucketPrimeStart;
+
+    // Kernels cross 8 multiples, spanning prime bytes, at a time so they are only used
+    // where they can run several times per segment
+    Prime kernelLimit;
+    prime_set_num(kernelLimit, KERNEL_PRIME_LIMIT);
+    kernelPrimeEnd = findPrimeIndex(kernelLimit);
+    if (kernelPrimeEnd < lowPrimeCount) kernelPrimeEnd = lowPrimeCount;
+    if (kernelPrimeEnd > segmentPrimeEnd) kernelPrimeEnd = segmentPrimeEnd;
+    if (verbose) stdLog("Applying %zd primes in segments of %d bytes", segmentPrimeEnd - lowPrimeCount, SEGMENT_SIZE);
+}
+
+
+
+static void setupCarry() {
+    carryPrimeEnd = segmentPrimeEnd;
+    carryStepMods = NULL;
+
+    // Carrying needs the same conditions as the bucket sieve: bitmaps starting on chunk boundaries and
+    // threads with more than one chunk.  The distance between a thread's chunks must also be native.
+    if (useWheel || bucketChunkTotal <= threadCount || bucketChunkSpan > SIZE_MAX / 4 / threadCount) {
+        if (verbose) stdLog("Sieving offsets are not carried between chunks");
+        return;
+    }
+    if (bucketPrimeStart > carryPrimeEnd) carryPrimeEnd = bucketPrimeStart;
+
+    size_t skipSpan = bucketChunkSpan * (threadCount - 1);
+    carryStepMods = mallocSafe((carryPrimeEnd - lowPrimeCount + 1) * sizeof(size_t));
+    for (size_t i = lowPrimeCount; i < carryPrimeEnd; ++i) {
+        carryStepMods[i - lowPrimeCount] = skipSpan % ((size_t) primes[i] * 2);
+    }
+    if (verbose) stdLog("Carrying offsets between chunks for %zd primes", carryPrimeEnd - lowPrimeCount);
+}
+
+
+
+// Moves every carried offset on from chunkNum (starting at from) to the thread's next chunk.
+// Offsets which can not be found without division are marked CARRY_UNKNOWN.
+static void carryOffsets(ThreadDescriptor * thread, size_t chunkNum, Prime from) {
+    // The bitmap may start after the chunk boundary (only the first chunk)
+    Prime tmp;
+    prime_set_num(tmp, chunkNum);
+    prime_mul_prime(tmp, tmp, chunkSize);
+    prime_add_prime(tmp, tmp, chunkOrigin);
+    prime_sub_prime(tmp, from, tmp);
+    size_t shift = prime_get_num(tmp);
+
+    const SievePrime * primes = thread->primes;
+    size_t nextChunkSpan = bucketChunkSpan * threadCount;
+    size_t * offsets = thread->primeOffsets;
+    for (size_t i = 0; i < carryPrimeEnd - lowPrimeCount; ++i) {
+        if (offsets[i] >= CARRY_UNKNOWN) continue;
+        size_t value = offsets[i] + shift;
+        size_t stepSize = (size_t) primes[lowPrimeCount + i] * 2;
+        if (value >= nextChunkSpan) {
+            offsets[i] = value - nextChunkSpan;
+        }
+        else if (value - bucketChunkSpan < stepSize) {
+            // The next multiple after this chunk, wound back by the chunks in between
+            value -= bucketChunkSpan;
+            if (value < carryStepMods[i]) value += stepSize;
+            offsets[i] = value - carryStepMods[i];
+        }
+        else {
+            // prime^2 lies between the two chunks
+            offsets[i] = CARRY_UNKNOWN;
+        }
+    }
+    thread->carriedChunk = chunkNum + threadCount;
+}
+
+
+
+// Finds the position in each pre-sieve pattern of the first byte of a bitmap starting at base
+static void getPatternOffsets(Prime base, size_t * offsets) {
+    for (int i = 0; i < preSievePatternCount; ++i) {
+        PreSievePattern * pattern = preSievePatterns + i;
+        Prime tmp;
+        if (useWheel) {
+            // Base is a multiple of 30 so this is simply its byte number
+            prime_div_num(tmp, base, WHEEL_SPAN);
+            prime_mod_num(tmp, tmp, pattern->period);
+            offsets[i] = prime_get_num(tmp);
+        }
+        else {
+            prime_mod_num(tmp, base, pattern->period);
+            offsets[i] = (prime_get_num(tmp) * pattern->multiplyer) % pattern->period;
+        }
+    }
+}
+
+
+
+// Copies (or ANDs) a pre-sieve pattern into part of a bitmap.  offset is the position in the pattern of the
+// first byte, it is moved on ready for the next part.
+static void applyPattern(unsigned char * bitmap, size_t size, const PreSievePattern * pattern, size_t * offset, int copy) {
+    while (size > 0) {
+        size_t partSize = pattern->size - *offset;
+        if (partSize > size) partSize = size;
+        const unsigned char * source = pattern->map + *offset;
+        if (copy) {
+            memcpy(bitmap, source, partSize);
+        }
+        else {
+            size_t i = 0;
+            for (; i + sizeof(uint64_t) <= partSize; i += sizeof(uint64_t)) {
+                uint64_t word, mask;
+                memcpy(&word, bitmap + i, sizeof(uint64_t));
+                memcpy(&mask, source + i, sizeof(uint64_t));
+                word &= mask;
+                memcpy(bitmap + i, &word, sizeof(uint64_t));
             }
+            for (; i < partSize; ++i) bitmap[i] &= source[i];
         }
-        ++i;
+        bitmap += partSize;
+        size -= partSize;
+        *offset += partSize;
+        if (*offset == pattern->size) *offset = 0;
     }
+}
 
-    free(bitmap);
 
-    if (!silent) stdLog("Prime array now full with %zd primes", primeCount);
+
+// Initialises part of a bitmap with every pre-sieve pattern
+static void preSieve(const PreSievePattern * patterns, unsigned char * bitmap, size_t size, size_t * offsets) {
+    if (!preSievePatternCount) {
+        memset(bitmap, 0xFF, size);
+        return;
+    }
+    applyPattern(bitmap, size, patterns, offsets, 1);
+    for (int i = 1; i < preSievePatternCount; ++i) {
+        applyPattern(bitmap, size, patterns + i, offsets + i, 0);
+    }
 }
 
 
 
-static void finalSelf() {
-    free(primes);
-    free(lowPrimeMap);
+static void growBuckets(ThreadDescriptor * thread, size_t required) {
+    size_t newCount = thread->bucketCount * 2;
+    while (newCount < required) newCount *= 2;
+
+    Bucket * newBuckets = mallocSafe(newCount * sizeof(Bucket));
+    memset(newBuckets, 0, newCount * sizeof(Bucket));
+    for (size_t i = 0; i < thread->bucketCount; ++i) {
+        size_t chunkNum = thread->currentChunk + i;
+        newBuckets[chunkNum % newCount] = thread->buckets[chunkNum % thread->bucketCount];
+    }
+    free(thread->buckets);
+    thread->buckets = newBuckets;
+    thread->bucketCount = newCount;
+}
+
+
+
+// Files a prime in the bucket for the next chunk belonging to this thread that one of its multiples lands in.
+// The offset may lie beyond the end of chunkNum.
+static void fileBucketEntry(ThreadDescriptor * thread, size_t chunkNum, size_t offset, size_t step) {
+    chunkNum += offset / bucketChunkSpan;
+    offset %= bucketChunkSpan;
+    while (chunkNum < bucketChunkTotal && chunkNum % threadCount != thread->threadNum - 1) {
+        offset += step;
+        chunkNum += offset / bucketChunkSpan;
+        offset %= bucketChunkSpan;
+    }
+    if (chunkNum >= bucketChunkTotal) return;
+
+    if (chunkNum - thread->currentChunk >= thread->bucketCount) {
+        growBuckets(thread, chunkNum - thread->currentChunk + 1);
+    }
+    Bucket * bucket = thread->buckets + (chunkNum % thread->bucketCount);
+    if (bucket->count == bucket->allocated) {
+        bucket->allocated = bucket->allocated ? bucket->allocated * 2 : BUCKET_ALLOC_UNIT;
+        bucket->entries = reallocSafe(bucket->entries, bucket->allocated * sizeof(BucketEntry));
+    }
+    bucket->entries[bucket->count].offset = offset;
+    bucket->entries[bucket->count].step = step;
+    ++bucket->count;
+}
+
+
+
+// Files every bucket prime ready for the thread's first chunk.
+// This is the only time the thread needs to divide to find a bucket prime's multiples.
+static void fileBucketPrimes(ThreadDescriptor * thread, size_t chunkNum, Prime from) {
+    const SievePrime * primes = thread->primes;
+
+    // Bitmaps always start on an even number greater than 1, see process()
+    Prime base;
+    prime_cp(base, from);
+    if (prime_is_odd(base)) prime_sub_num(base, base, 1);
+    Prime prime_2;
+    prime_set_num(prime_2, 2);
+    if (prime_lt(base, prime_2)) prime_cp(base, prime_2);
+
+    thread->currentChunk = chunkNum;
+    thread->bucketCount = ((size_t) primes[bucketPrimeEnd - 1] * 2) / bucketChunkSpan + 2;
+    thread->buckets = mallocSafe(thread->bucketCount * sizeof(Bucket));
+    memset(thread->buckets, 0, thread->bucketCount * sizeof(Bucket));
+
+    for (size_t i = bucketPrimeStart; i < bucketPrimeEnd; ++i) {
+        // Find the first odd multiple at or above both prime^2 and base
+        Prime prime, value;
+        prime_set_num(prime, primes[i]);
+        prime_mul_prime(value, prime, prime);
+        if (prime_lt(value, base)) {
+            prime_sub_num(value, base, 1);
+            prime_mod_prime(value, value, prime);
+            prime_sub_prime(value, prime, value);
+            prime_sub_num(value, value, 1);
+            if (!prime_is_odd(value)) prime_add_prime(value, value, prime);
+            prime_add_prime(value, value, base);
+        }
+        if (prime_ge(value, endValue)) continue;
+
+        Prime entryChunk, tmp;
+        prime_sub_prime(value, value, chunkOrigin);
+        prime_div_prime(entryChunk, value, chunkSize);
+        prime_mul_prime(tmp, entryChunk, chunkSize);
+        prime_sub_prime(value, value, tmp);
+        fileBucketEntry(thread, prime_get_num(entryChunk), prime_get_num(value), (size_t) primes[i] * 2);
+    }
+}
+
+
+
+// Removes the multiples of every prime filed for this chunk and re-files each one for its next multiple
+static void applyBuckets(ThreadDescriptor * thread, size_t chunkNum, Prime from, unsigned char * map, size_t mapSize) {
+    thread->currentChunk = chunkNum;
+
+    // Take the bucket out of the ring while it's being emptied
+    Bucket bucket = thread->buckets[chunkNum % thread->bucketCount];
+    memset(thread->buckets + (chunkNum % thread->bucketCount), 0, sizeof(Bucket));
+
+    // The bitmap may start after the chunk boundary (only the first chunk)
+    Prime tmp;
+    prime_set_num(tmp, chunkNum);
+    prime_mul_prime(tmp, tmp, chunkSize);
+    prime_add_prime(tmp, tmp, chunkOrigin);
+    prime_sub_prime(tmp, from, tmp);
+    size_t shift = prime_get_num(tmp);
+
+    size_t mapBits = mapSize * 16;
+    for (BucketEntry * entry = bucket.entries; entry < bucket.entries + bucket.count; ++entry) {
+        size_t value = entry->offset - shift;
+        if (value < mapBits) map[value >> 4] &= removeMask[value & 0x0F];
+        fileBucketEntry(thread, chunkNum, entry->offset + entry->step, entry->step);
+    }
+
+    // Give the memory back to the ring to be reused
+    Bucket * slot = thread->buckets + (chunkNum % thread->bucketCount);
+    if (slot->entries) {
+        free(bucket.entries);
+    }
+    else {
+        bucket.count = 0;
+        *slot = bucket;
+    }
+}
+
+
+
+static void freeBuckets(ThreadDescriptor * thread) {
+    for (size_t i = 0; i < thread->bucketCount; ++i) free(thread->buckets[i].entries);
+    free(thread->buckets);
+    thread->buckets = NULL;
+    thread->bucketCount = 0;
+}
+
+
+
+// Finds the skipped primes (see output.h) which belong between from and to, returning how many there are
+static int getSkippedPrimes(Prime from, Prime to, unsigned int * skipped) {
+    int count = 0;
+    Prime value;
+    if (useWheel) {
+        static const unsigned int wheelPrimes[] = {2, 3, 5};
+        for (int i = 0; i < 3; ++i) {
+            prime_set_num(value, wheelPrimes[i]);
+            if (prime_le(from, value) && prime_lt(value, to)) skipped[count++] = wheelPrimes[i];
+        }
+    }
+    else {
+        prime_set_num(value, 2);
+        if (prime_le(from, value) && prime_ge(to, value) && !disallow2) skipped[count++] = 2;
+    }
+    return count;
 }
 
 
 
+// Counts the set bits in size bytes of a bitmap
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target_clones("popcnt", "default")))
+#endif
+static size_t countBits(const unsigned char * bitmap, size_t size) {
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, bitmap + i, sizeof(uint64_t));
+        count += __builtin_popcountll(word);
+    }
+    for (; i < size; ++i) count += bitCount[bitmap[i]];
+    return count;
+}
+
+
+
+// Adds the primes in a bitmap to the stats.  Every bit from "to" onwards must already be cleared (see process()).
+// Each time the primes gain a digit (crossing a power of 10) the bitmap is split and both sides counted separately.
 static void getPrimeStats(Prime from, Prime to, size_t range, unsigned char * bitmap, size_t * retTextSize, size_t * retFoundPrimes) {
     size_t textSize = *retTextSize;
     size_t foundPrimes = *retFoundPrimes;
+    Prime base;
+    getBitmapBase(base, from);
 
-    // Count primes in the file
     Prime tmp;
     PrimeString toString;
     prime_sub_num(tmp, to, 1);
     prime_to_str(toString, tmp);
-    size_t stringSize = strlen(toString);
-    size_t endRange = range -1;
+    size_t toDigits = strlen(toString);
     PrimeString fromString;
     prime_to_str(fromString, from);
-    if (strlen(fromString) == stringSize) {
-        // Fast
-        stringSize += 1;
-        for (size_t i=0; i<endRange; ++i) {
-            foundPrimes += bitCount[bitmap[i]];
-        }
-        if (bitmap[endRange]) {
-            for (int j = 1; j < 16; j+=2) {
-                if (bitmap[endRange] & checkMask[j]) {
-                    Prime value;
-                    getPrimeFromMap(value, from, endRange, j);
-                    if (prime_lt(value, to)) ++foundPrimes;
-                }
-            }
+    size_t digits = strlen(fromString);
+
+    size_t countedBytes = 0;
+    size_t partialBits = 0;
+    for (; digits < toDigits; ++digits) {
+        // Count everything below 10^digits
+        Prime powerOf10;
+        prime_set_num(powerOf10, 1);
+        for (size_t i = 0; i < digits; ++i) prime_mul_num(powerOf10, powerOf10, 10);
+        prime_sub_prime(tmp, powerOf10, base);
+        size_t offset = prime_get_num(tmp);
+        size_t byteIndex = offset / bitmapSpan;
+        size_t residue = offset % bitmapSpan;
+
+        size_t count = countBits(bitmap + countedBytes, byteIndex - countedBytes) - partialBits;
+        unsigned char below = 0;
+        for (int j = 0; j < 8; ++j) {
+            if (bitmapResidues[j] < residue) below |= 1 << j;
         }
-        textSize = foundPrimes * stringSize;
+        partialBits = bitCount[bitmap[byteIndex] & below];
+        count += partialBits;
+        countedBytes = byteIndex;
+
+        foundPrimes += count;
+        textSize += count * (digits + 1);
+    }
+    size_t count = countBits(bitmap + countedBytes, range - countedBytes) - partialBits;
+    foundPrimes += count;
+    textSize += count * (toDigits + 1);
+
+    *retTextSize = textSize;
+    *retFoundPrimes = foundPrimes;
+}
+
+
+
+static void writeSafe(int file, const void * buffer, size_t size) {
+    if (write(file, buffer, size) != size) exitError(1, errno, "Failed to write prime file");
+}
+
+
+
+// Sets up an io_uring for writer, leaving writer->ring as -1 (so write() is used) if the kernel can't.
+static void initAsyncWriter(AsyncWriter * writer) {
+    memset(writer, 0, sizeof(AsyncWriter));
+    writer->ring = -1;
+    writer->file = -1;
+    if (!useIoUring) return;
+#ifdef HAVE_IO_URING
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring = syscall(__NR_io_uring_setup, ASYNC_WRITE_BUFFERS, &params);
+    if (ring < 0) {
+        logWarning(errno, "Could not set up io_uring, writing with write() instead");
+        return;
+    }
+
+    writer->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    writer->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (writer->cqRingSize > writer->sqRingSize) writer->sqRingSize = writer->cqRingSize;
+        writer->cqRingSize = 0;
+    }
+    writer->sqRing = mmap(NULL, writer->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring, IORING_OFF_SQ_RING);
+    writer->cqRing = writer->cqRingSize ? mmap(NULL, writer->cqRingSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING) : writer->sqRing;
+    writer->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    writer->sqes = mmap(NULL, writer->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring, IORING_OFF_SQES);
+    if (writer->sqRing == MAP_FAILED || writer->cqRing == MAP_FAILED || writer->sqes == MAP_FAILED)
+        exitError(1, errno, "Could not map io_uring");
+
+    unsigned char * sq = writer->sqRing;
+    unsigned char * cq = writer->cqRing;
+    writer->sqTail  = (unsigned *) (sq + params.sq_off.tail);
+    writer->sqMask  = (unsigned *) (sq + params.sq_off.ring_mask);
+    writer->sqArray = (unsigned *) (sq + params.sq_off.array);
+    writer->cqHead  = (unsigned *) (cq + params.cq_off.head);
+    writer->cqTail  = (unsigned *) (cq + params.cq_off.tail);
+    writer->cqMask  = (unsigned *) (cq + params.cq_off.ring_mask);
+    writer->cqes    = cq + params.cq_off.cqes;
+    for (int i = 0; i < ASYNC_WRITE_BUFFERS; ++i) writer->buffers[i].data = mallocSafe(WRITE_BUFFER_SIZE);
+    writer->ring = ring;
+#endif
+}
+
+
+
+#ifdef HAVE_IO_URING
+// Takes every completed write off the completion queue, waiting for at least one if wait is set.
+static void reapAsyncWrites(AsyncWriter * writer, int wait) {
+    if (wait && syscall(__NR_io_uring_enter, writer->ring, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+        exitError(1, errno, "Failed to wait for io_uring");
+
+    unsigned head = *writer->cqHead;
+    unsigned tail = __atomic_load_n(writer->cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        struct io_uring_cqe * cqe = ((struct io_uring_cqe *) writer->cqes) + (head & *writer->cqMask);
+        AsyncWriteBuffer * buffer = writer->buffers + cqe->user_data;
+        if (cqe->res < 0) exitError(1, -cqe->res, "Failed to write prime file");
+
+        // Anything short is finished off synchronously, order is kept by the offset or by being the only write
+        size_t written = cqe->res;
+        while (written < buffer->size) {
+            ssize_t result = buffer->offset < 0
+                    ? write(writer->file, buffer->data + written, buffer->size - written)
+                    : pwrite(writer->file, buffer->data + written, buffer->size - written, buffer->offset + written);
+            if (result <= 0) exitError(1, errno, "Failed to write prime file");
+            written += result;
+        }
+        buffer->busy = 0;
+        --writer->inFlight;
+    }
+    __atomic_store_n(writer->cqHead, head, __ATOMIC_RELEASE);
+}
+#endif
+
+
+
+// Waits for every write to finish leaving the file position after the last one
+static void drainAsyncWrites(AsyncWriter * writer) {
+#ifdef HAVE_IO_URING
+    if (writer->ring < 0) return;
+    while (writer->inFlight) reapAsyncWrites(writer, 1);
+    if (writer->file >= 0 && writer->offset >= 0) lseek(writer->file, writer->offset, SEEK_SET);
+    writer->file = -1;
+#endif
+}
+
+
+
+// Copies data into the writer's buffers and submits it, waiting only when every buffer is in flight
+static void asyncWrite(AsyncWriter * writer, int file, const void * data, size_t size) {
+#ifdef HAVE_IO_URING
+    if (writer->ring < 0) {
+        writeSafe(file, data, size);
+        return;
+    }
+    if (file != writer->file) {
+        drainAsyncWrites(writer);
+        writer->file = file;
+        writer->offset = lseek(file, 0, SEEK_CUR);
+        int flags = fcntl(file, F_GETFL);
+        if (flags == -1 || (flags & O_APPEND)) writer->offset = -1;
+    }
+
+    int maxInFlight = writer->offset < 0 ? 1 : ASYNC_WRITE_BUFFERS;
+    while (size) {
+        reapAsyncWrites(writer, 0);
+        while (writer->inFlight >= maxInFlight) reapAsyncWrites(writer, 1);
+        int index = 0;
+        while (writer->buffers[index].busy) ++index;
+        AsyncWriteBuffer * buffer = writer->buffers + index;
+        buffer->size = size > WRITE_BUFFER_SIZE ? WRITE_BUFFER_SIZE : size;
+        buffer->offset = writer->offset;
+        buffer->busy = 1;
+        memcpy(buffer->data, data, buffer->size);
+
+        unsigned tail = *writer->sqTail;
+        unsigned slot = tail & *writer->sqMask;
+        struct io_uring_sqe * sqe = ((struct io_uring_sqe *) writer->sqes) + slot;
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = file;
+        sqe->addr = (unsigned long) buffer->data;
+        sqe->len = buffer->size;
+        sqe->off = buffer->offset < 0 ? (unsigned long long) -1 : (unsigned long long) buffer->offset;
+        sqe->user_data = index;
+        writer->sqArray[slot] = slot;
+        __atomic_store_n(writer->sqTail, tail + 1, __ATOMIC_RELEASE);
+        while (syscall(__NR_io_uring_enter, writer->ring, 1, 0, 0, NULL, 0) < 0) {
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) exitError(1, errno, "Failed to submit to io_uring");
+            reapAsyncWrites(writer, writer->inFlight > 0);
+        }
+        ++writer->inFlight;
+
+        if (writer->offset >= 0) writer->offset += buffer->size;
+        data = ((const char *) data) + buffer->size;
+        size -= buffer->size;
+    }
+#else
+    writeSafe(file, data, size);
+#endif
+}
+
+
+
+static void finalAsyncWriter(AsyncWriter * writer) {
+#ifdef HAVE_IO_URING
+    if (writer->ring < 0) return;
+    drainAsyncWrites(writer);
+    for (int i = 0; i < ASYNC_WRITE_BUFFERS; ++i) free(writer->buffers[i].data);
+    munmap(writer->sqes, writer->sqesSize);
+    if (writer->cqRingSize) munmap(writer->cqRing, writer->cqRingSize);
+    munmap(writer->sqRing, writer->sqRingSize);
+    close(writer->ring);
+    writer->ring = -1;
+#endif
+}
+
+
+
+static void initDirectWriter(DirectWriter * writer) {
+    writer->file = -1;
+    writer->buffer = NULL;
+    writer->size = 0;
+}
+
+
+
+// Writes everything buffered for the file, which must be done before it is closed.
+// O_DIRECT is then switched off to write the last part block, leaving the file position unaligned.
+static void flushDirectWrites(DirectWriter * writer) {
+    if (writer->file == -1) return;
+    size_t directSize = writer->size - writer->size % DIRECT_IO_ALIGNMENT;
+    writeSafe(writer->file, writer->buffer, directSize);
+    if (directSize < writer->size) {
+        if (fcntl(writer->file, F_SETFL, fcntl(writer->file, F_GETFL) & ~O_DIRECT))
+            exitError(1, errno, "Could not switch off direct I/O");
+        writeSafe(writer->file, writer->buffer + directSize, writer->size - directSize);
+    }
+    writer->file = -1;
+    writer->size = 0;
+}
+
+
+
+static void directWrite(DirectWriter * writer, int file, const void * data, size_t size) {
+    if (file != writer->file) {
+        flushDirectWrites(writer);
+        int flags = fcntl(file, F_GETFL);
+        if (flags == -1 || !(flags & O_DIRECT)) {
+            writeSafe(file, data, size);
+            return;
+        }
+        writer->file = file;
+        if (!writer->buffer) {
+            void * buffer;
+            int result = posix_memalign(&buffer, DIRECT_IO_ALIGNMENT, WRITE_BUFFER_SIZE);
+            if (result) exitError(1, result, "Could not allocate direct I/O buffer");
+            writer->buffer = buffer;
+        }
+    }
+
+    while (size) {
+        size_t partSize = WRITE_BUFFER_SIZE - writer->size;
+        if (partSize > size) partSize = size;
+        memcpy(writer->buffer + writer->size, data, partSize);
+        writer->size += partSize;
+        data = ((const char *) data) + partSize;
+        size -= partSize;
+        if (writer->size == WRITE_BUFFER_SIZE) {
+            writeSafe(file, writer->buffer, WRITE_BUFFER_SIZE);
+            writer->size = 0;
+        }
+    }
+}
+
+
+
+static void finalDirectWriter(DirectWriter * writer) {
+    flushDirectWrites(writer);
+    free(writer->buffer);
+    writer->buffer = NULL;
+}
+
+
+
+// Allocates a chunk's file at its final size before it is written so it is not fragmented as it grows.
+// This is only an optimisation, if the file system can't (or there is no chunk file) nothing changes.
+static void preallocateOutput(int file, size_t size) {
+    if (preallocateFiles && size) fallocate(file, 0, 0, size);
+}
+
+
+
+// Takes a buffer from spare, allocating one if there are none
+static OutputBuffer * newOutputBuffer(OutputBuffer ** spare) {
+    OutputBuffer * buffer = *spare;
+    if (buffer) *spare = buffer->next;
+    else buffer = mallocSafe(sizeof(OutputBuffer) + WRITE_BUFFER_SIZE);
+    buffer->next = NULL;
+    buffer->size = 0;
+    buffer->capacity = WRITE_BUFFER_SIZE;
+    return buffer;
+}
+
+
+
+// Puts a written buffer on spare to be used again, unless it is not the usual size
+static void releaseOutputBuffer(OutputBuffer ** spare, OutputBuffer * buffer) {
+    if (buffer->capacity == WRITE_BUFFER_SIZE) {
+        buffer->next = *spare;
+        *spare = buffer;
     }
     else {
-        // Slow
-        stringSize = 2;
-        PrimeString stringMaxAtSize = "9";
-        Prime maxAtSize;
-        prime_set_num(maxAtSize, 9);
-        for (size_t i = 0; i < endRange; ++i) {
-            if (bitmap[i]) {
-                for (int j = 1; j < 16; j+=2) {
-                    if (bitmap[i] & checkMask[j]) {
-                        Prime value;
-                        getPrimeFromMap(value, from, i, j);
-                        while (prime_gt(value, maxAtSize)) {
-                            strcat(stringMaxAtSize,"9");
-                            str_to_prime(maxAtSize, stringMaxAtSize);
-                            ++stringSize;
-                        }
-                        ++foundPrimes;
-                        textSize += stringSize;
-                    }
-                }
+        free(buffer);
+    }
+}
+
+
+
+static void freeOutputBuffers(OutputBuffer * buffer) {
+    while (buffer) {
+        OutputBuffer * next = buffer->next;
+        free(buffer);
+        buffer = next;
+    }
+}
+
+
+
+static void initSpliceWriter(SpliceWriter * writer) {
+    memset(writer, 0, sizeof(SpliceWriter));
+    writer->file = -1;
+    writer->through[0] = -1;
+    writer->through[1] = -1;
+}
+
+
+
+// Enlarges a pipe to SPLICE_PIPE_SIZE (if allowed) returning its capacity in pages
+static size_t setPipeSize(int pipe) {
+    fcntl(pipe, F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    int size = fcntl(pipe, F_GETPIPE_SZ);
+    if (size <= 0) exitError(1, errno, "Could not read the size of the output pipe");
+    return size / sysconf(_SC_PAGESIZE);
+}
+
+
+
+// Moves buffers the reader must have taken from writer->inPipe onto spare.  Once the file is closed that is all of them.
+static void reclaimSplicedBuffers(SpliceWriter * writer, OutputBuffer ** spare) {
+    while (writer->inPipe && (writer->file == -1
+            || writer->inPipe->pipeMark + writer->pipePages <= writer->pagesSpliced)) {
+        OutputBuffer * buffer = writer->inPipe;
+        writer->inPipe = buffer->next;
+        releaseOutputBuffer(spare, buffer);
+    }
+    if (!writer->inPipe) writer->lastInPipe = NULL;
+}
+
+
+
+// Called once the file is closed, the reader can then no longer be using any of the buffers
+static void endSplice(SpliceWriter * writer, OutputBuffer ** spare) {
+    writer->file = -1;
+    reclaimSplicedBuffers(writer, spare);
+}
+
+
+
+static void startSplice(SpliceWriter * writer, int file, OutputBuffer ** spare) {
+    endSplice(writer, spare);
+    struct stat fileStat;
+    int flags = fcntl(file, F_GETFL);
+    if (flags == -1 || fstat(file, &fileStat)) exitError(1, errno, "Could not read the type of the output file");
+
+    writer->file = file;
+    writer->pagesSpliced = 0;
+    if (S_ISFIFO(fileStat.st_mode)) {
+        writer->mode = SPLICE_TO_PIPE;
+        writer->pipePages = setPipeSize(file);
+    }
+    else if (S_ISREG(fileStat.st_mode) && !(flags & O_APPEND)) {
+        writer->mode = SPLICE_TO_FILE;
+        if (writer->through[0] == -1) {
+            if (pipe(writer->through)) exitError(1, errno, "Could not create a pipe to splice output through");
+            writer->pipePages = setPipeSize(writer->through[1]);
+        }
+    }
+    else {
+        writer->mode = SPLICE_WRITE;
+    }
+}
+
+
+
+// Gives the pages of data to a pipe, counting how many pipe buffers that takes (one for each page)
+static void vmspliceSafe(SpliceWriter * writer, int pipe, const char * data, size_t size) {
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    while (size) {
+        struct iovec part = { (void *) data, size };
+        ssize_t result = vmsplice(pipe, &part, 1, 0);
+        if (result <= 0) exitError(1, result ? errno : 0, "Failed to write prime file");
+        writer->pagesSpliced += ((uintptr_t) data + result - 1) / pageSize - ((uintptr_t) data) / pageSize + 1;
+        data += result;
+        size -= result;
+    }
+}
+
+
+
+// Splices data to a regular file through writer->through.  That is emptied each time so data may be reused on return.
+static void spliceToFile(SpliceWriter * writer, const char * data, size_t size) {
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    while (size) {
+        // No more than the pipe holds so vmsplice() never waits
+        size_t partSize = writer->pipePages * pageSize - ((uintptr_t) data) % pageSize;
+        if (partSize > size) partSize = size;
+        vmspliceSafe(writer, writer->through[1], data, partSize);
+        for (size_t moved = 0; moved < partSize;) {
+            ssize_t result = splice(writer->through[0], NULL, writer->file, NULL, partSize - moved, SPLICE_F_MOVE);
+            if (result <= 0) exitError(1, result ? errno : 0, "Failed to write prime file");
+            moved += result;
+        }
+        data += partSize;
+        size -= partSize;
+    }
+}
+
+
+
+// Writes a buffer from newOutputBuffer(), which belongs to the writer until it is reclaimed to spare
+static void spliceOutputBuffer(SpliceWriter * writer, int file, OutputBuffer * buffer, OutputBuffer ** spare) {
+    if (file != writer->file) startSplice(writer, file, spare);
+    if (writer->mode == SPLICE_TO_PIPE) {
+        vmspliceSafe(writer, file, buffer->data, buffer->size);
+        buffer->pipeMark = writer->pagesSpliced;
+        buffer->next = NULL;
+        if (writer->lastInPipe) writer->lastInPipe->next = buffer;
+        else writer->inPipe = buffer;
+        writer->lastInPipe = buffer;
+        reclaimSplicedBuffers(writer, spare);
+    }
+    else {
+        if (writer->mode == SPLICE_TO_FILE) spliceToFile(writer, buffer->data, buffer->size);
+        else writeSafe(file, buffer->data, buffer->size);
+        releaseOutputBuffer(spare, buffer);
+    }
+}
+
+
+
+// Writes data which the caller will go on to reuse (such as a bitmap).
+// For pipes the end of it is copied, once pipePages pages of copies are in the pipe the reader has taken the rest.
+static void spliceWrite(SpliceWriter * writer, int file, const void * data, size_t size, OutputBuffer ** spare) {
+    if (file != writer->file) startSplice(writer, file, spare);
+    if (writer->mode == SPLICE_TO_FILE) {
+        spliceToFile(writer, data, size);
+    }
+    else if (writer->mode == SPLICE_TO_PIPE) {
+        size_t copySize = writer->pipePages * sysconf(_SC_PAGESIZE);
+        if (size > copySize) {
+            vmspliceSafe(writer, file, data, size - copySize);
+            data = ((const char *) data) + size - copySize;
+            size = copySize;
+        }
+        while (size) {
+            OutputBuffer * buffer = newOutputBuffer(spare);
+            buffer->size = size > WRITE_BUFFER_SIZE ? WRITE_BUFFER_SIZE : size;
+            memcpy(buffer->data, data, buffer->size);
+            data = ((const char *) data) + buffer->size;
+            size -= buffer->size;
+            spliceOutputBuffer(writer, file, buffer, spare);
+        }
+    }
+    else {
+        writeSafe(file, data, size);
+    }
+}
+
+
+
+static void finalSpliceWriter(SpliceWriter * writer, OutputBuffer ** spare) {
+    reclaimSplicedBuffers(writer, spare);
+    // Anything left may still be in a pipe which is open so is never freed
+    writer->inPipe = NULL;
+    writer->lastInPipe = NULL;
+    if (writer->through[0] != -1) {
+        close(writer->through[0]);
+        close(writer->through[1]);
+    }
+}
+
+
+
+// Finds the queue for a chunk's output, adding it in order if it is not there.  outputMutex must be held.
+static ChunkOutput * getChunkOutput(size_t chunkNum) {
+    ChunkOutput ** position = &pendingChunks;
+    while (*position && (*position)->chunkNum < chunkNum) position = &(*position)->next;
+    if (*position && (*position)->chunkNum == chunkNum) return *position;
+
+    ChunkOutput * chunk = mallocSafe(sizeof(ChunkOutput));
+    memset(chunk, 0, sizeof(ChunkOutput));
+    chunk->chunkNum = chunkNum;
+    chunk->next = *position;
+    *position = chunk;
+    return chunk;
+}
+
+
+
+// Adds a buffer to the reorder buffer for the thread's chunk, the writer thread frees it once written.
+// Once the reorder buffer is full, threads wait for the writer thread to make space, except for the chunk being
+// written which is never held up (otherwise every thread could be waiting on later chunks).
+static void queueOutputBuffer(ThreadDescriptor * thread, OutputBuffer * buffer) {
+    pthread_mutex_lock(&outputMutex);
+    while (queuedBytes >= queuedByteLimit && thread->writeChunk != nextWriteChunk) {
+        pthread_cond_wait(&outputWritten, &outputMutex);
+    }
+    queuedBytes += buffer->size;
+
+    buffer->next = NULL;
+    ChunkOutput * chunk = getChunkOutput(thread->writeChunk);
+    if (chunk->last) chunk->last->next = buffer;
+    else chunk->first = buffer;
+    chunk->last = buffer;
+    pthread_cond_signal(&outputQueued);
+    pthread_mutex_unlock(&outputMutex);
+}
+
+
+
+// Copies output for the calling thread's chunk into the reorder buffer
+static void queueOutput(const void * data, size_t size) {
+    ThreadDescriptor * thread = threads + (*((int*)pthread_getspecific(threadNumKey))) - 1;
+    while (size) {
+        size_t partSize = size > WRITE_BUFFER_SIZE ? WRITE_BUFFER_SIZE : size;
+        OutputBuffer * buffer = mallocSafe(sizeof(OutputBuffer) + partSize);
+        buffer->size = partSize;
+        buffer->capacity = partSize;
+        memcpy(buffer->data, data, partSize);
+        queueOutputBuffer(thread, buffer);
+
+        data = ((const char *) data) + partSize;
+        size -= partSize;
+    }
+}
+
+
+
+static void writeOutput(int file, const void * buffer, size_t size) {
+    ThreadDescriptor * thread = threads + (*((int*)pthread_getspecific(threadNumKey))) - 1;
+    if (orderedOutput) queueOutput(buffer, size);
+    else if (useSplice) spliceWrite(&thread->spliceWriter, file, buffer, size, &thread->spareBuffers);
+    else if (useIoUring) asyncWrite(&thread->asyncWriter, file, buffer, size);
+    else if (directIo) directWrite(&thread->directWriter, file, buffer, size);
+    else writeSafe(file, buffer, size);
+}
+
+
+
+// An empty buffer of WRITE_BUFFER_SIZE bytes for the calling thread to format output into
+static OutputBuffer * getOutputBuffer() {
+    ThreadDescriptor * thread = threads + (*((int*)pthread_getspecific(threadNumKey))) - 1;
+    return newOutputBuffer(&thread->spareBuffers);
+}
+
+
+
+// Writes a buffer from getOutputBuffer(), handing the buffer itself on where possible instead of copying it
+static void writeOutputBuffer(int file, OutputBuffer * buffer) {
+    ThreadDescriptor * thread = threads + (*((int*)pthread_getspecific(threadNumKey))) - 1;
+    if (orderedOutput && buffer->size) {
+        queueOutputBuffer(thread, buffer);
+    }
+    else if (useSplice && buffer->size) {
+        spliceOutputBuffer(&thread->spliceWriter, file, buffer, &thread->spareBuffers);
+    }
+    else {
+        writeOutput(file, buffer->data, buffer->size);
+        releaseOutputBuffer(&thread->spareBuffers, buffer);
+    }
+}
+
+
+
+// Called by the writers when a chunk's output is complete
+static void finishOutput() {
+    if (!orderedOutput) return;
+    ThreadDescriptor * thread = threads + (*((int*)pthread_getspecific(threadNumKey))) - 1;
+    pthread_mutex_lock(&outputMutex);
+    getChunkOutput(thread->writeChunk)->finished = 1;
+    pthread_cond_signal(&outputQueued);
+    pthread_mutex_unlock(&outputMutex);
+}
+
+
+
+// The writer thread, writes every chunk's output to theSingleFile in order
+static void * writeOrderedOutput(void * unused) {
+    AsyncWriter writer;
+    initAsyncWriter(&writer);
+    SpliceWriter splicer;
+    initSpliceWriter(&splicer);
+    DirectWriter direct;
+    initDirectWriter(&direct);
+    OutputBuffer * written = NULL;
+    pthread_mutex_lock(&outputMutex);
+    while (nextWriteChunk < chunkTotal) {
+        ChunkOutput * chunk = pendingChunks;
+        if (!chunk || chunk->chunkNum != nextWriteChunk) {
+            pthread_cond_wait(&outputQueued, &outputMutex);
+        }
+        else if (chunk->first) {
+            OutputBuffer * buffer = chunk->first;
+            chunk->first = buffer->next;
+            if (!chunk->first) chunk->last = NULL;
+            pthread_mutex_unlock(&outputMutex);
+
+            size_t size = buffer->size;
+            if (useSplice) {
+                spliceOutputBuffer(&splicer, theSingleFile, buffer, &written);
+            }
+            else {
+                if (directIo) directWrite(&direct, theSingleFile, buffer->data, buffer->size);
+                else asyncWrite(&writer, theSingleFile, buffer->data, buffer->size);
+                buffer->next = written;
+                written = buffer;
             }
+
+            pthread_mutex_lock(&outputMutex);
+            queuedBytes -= size;
+            freeOutputBuffers(written);
+            written = NULL;
+            pthread_cond_broadcast(&outputWritten);
         }
-        if (bitmap[endRange]) {
-            for (int j = 1; j < 16; j+=2) {
-                if (bitmap[endRange] & checkMask[j]) {
-                    Prime value;
-                    getPrimeFromMap(value, from, endRange, j);
-                    if (prime_lt(value, to)) {
-                        while (prime_gt(value, maxAtSize)) {
-                            strcat(stringMaxAtSize,"9");
-                            str_to_prime(maxAtSize, stringMaxAtSize);
-                            ++stringSize;
-                        }
-                        ++foundPrimes;
-                        textSize += stringSize;
-                    }
-                }
+        else if (chunk->finished) {
+            pendingChunks = chunk->next;
+            free(chunk);
+            ++nextWriteChunk;
+            pthread_cond_broadcast(&outputWritten);
+        }
+        else {
+            pthread_cond_wait(&outputQueued, &outputMutex);
+        }
+    }
+    pthread_mutex_unlock(&outputMutex);
+    finalAsyncWriter(&writer);
+    finalSpliceWriter(&splicer, &written);
+    freeOutputBuffers(written);
+    finalDirectWriter(&direct);
+    return NULL;
+}
+
+
+
+// Formats one part of a text job into a buffer of exactly the right size (found with getPrimeStats())
+static OutputBuffer * formatTextPart(TextJob * job, size_t part) {
+    size_t partStart = part * TEXT_PART_SIZE;
+    size_t partSize = job->range - partStart;
+    if (partSize > TEXT_PART_SIZE) partSize = TEXT_PART_SIZE;
+    const unsigned char * bitmap = job->bitmap + partStart;
+
+    Prime from, to;
+    prime_set_num(from, partStart);
+    prime_mul_num(from, from, bitmapSpan);
+    prime_add_prime(from, from, job->base);
+    prime_set_num(to, partSize);
+    prime_mul_num(to, to, bitmapSpan);
+    prime_add_prime(to, to, from);
+    if (prime_gt(to, job->to)) prime_cp(to, job->to);
+
+    int skippedCount = part ? 0 : job->skippedCount;
+    size_t textSize = skippedCount * 2;
+    size_t foundPrimes = 0;
+    getPrimeStats(from, to, partSize, (unsigned char *) bitmap, &textSize, &foundPrimes);
+    OutputBuffer * buffer = mallocSafe(sizeof(OutputBuffer) + textSize);
+    buffer->next = NULL;
+    buffer->size = textSize;
+    buffer->capacity = textSize;
+
+    char * bufferWritePos = buffer->data;
+    for (int i = 0; i < skippedCount; ++i) {
+        bufferWritePos[0] = '0' + job->skipped[i];
+        bufferWritePos[1] = '\n';
+        bufferWritePos += 2;
+    }
+
+    DecimalString decimal;
+    setDecimalString(&decimal, from);
+    size_t decimalOffset = 0;
+    unsigned short bits[BITMAP_BLOCK_SIZE * 8];
+    for (size_t blockStart = 0; blockStart < partSize; blockStart += BITMAP_BLOCK_SIZE) {
+        size_t blockSize = partSize - blockStart;
+        if (blockSize > BITMAP_BLOCK_SIZE) blockSize = BITMAP_BLOCK_SIZE;
+        size_t count = getBitmapBits(bitmap + blockStart, blockSize, bits);
+        for (size_t i = 0; i < count; ++i) {
+            size_t offset = (blockStart + (bits[i] >> 3)) * bitmapSpan + bitmapResidues[bits[i] & 7];
+            addToDecimalString(&decimal, offset - decimalOffset);
+            decimalOffset = offset;
+            size_t bytesWritten = copyDecimalString(bufferWritePos, &decimal);
+            bufferWritePos[bytesWritten] = '\n';
+            bufferWritePos += bytesWritten + 1;
+        }
+    }
+    if (bufferWritePos != buffer->data + textSize) exitError(1, 0, "Text for part %zd was %zd bytes, expected %zd",
+            part, (size_t) (bufferWritePos - buffer->data), textSize);
+    return buffer;
+}
+
+
+
+// Finds a part which may be started in any text job.  textMutex must be held.
+static TextJob * findTextPart() {
+    for (TextJob * job = textJobs; job; job = job->next) {
+        if (job->nextPart < job->partCount && job->nextPart < job->writtenParts + job->partsAhead) return job;
+    }
+    return NULL;
+}
+
+
+
+// Formats parts of text jobs until no thread is left processing chunks.  Called by threads with no chunks left.
+static void helpFormatText() {
+    pthread_mutex_lock(&textMutex);
+    while (1) {
+        TextJob * job = findTextPart();
+        if (job) {
+            size_t part = job->nextPart++;
+            pthread_mutex_unlock(&textMutex);
+            OutputBuffer * buffer = formatTextPart(job, part);
+            pthread_mutex_lock(&textMutex);
+            job->parts[part] = buffer;
+            pthread_cond_broadcast(&textPartFormatted);
+        }
+        else if (sievingThreads) {
+            pthread_cond_wait(&textPartsWaiting, &textMutex);
+        }
+        else {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&textMutex);
+}
+
+
+
+// Called by each thread once it has no chunks left to process
+static void finishSieving() {
+    pthread_mutex_lock(&textMutex);
+    --sievingThreads;
+    pthread_cond_broadcast(&textPartsWaiting);
+    pthread_mutex_unlock(&textMutex);
+}
+
+
+
+// Splits the bitmap into parts which threads with no chunks left can format at the same time.
+// The parts are written in order, the writing thread formats parts itself while waiting for the next.
+static void writePrimeTextInParts(Prime base, Prime to, size_t range, unsigned char * bitmap, int file,
+        unsigned int * skipped, int skippedCount) {
+    TextJob job;
+    prime_cp(job.base, base);
+    prime_cp(job.to, to);
+    job.bitmap = bitmap;
+    job.range = range;
+    memcpy(job.skipped, skipped, sizeof(job.skipped));
+    job.skippedCount = skippedCount;
+    job.partCount = (range + TEXT_PART_SIZE - 1) / TEXT_PART_SIZE;
+    if (!job.partCount) job.partCount = 1;
+    job.nextPart = 0;
+    job.writtenParts = 0;
+    job.partsAhead = TEXT_PARTS_AHEAD * threadCount;
+    job.parts = mallocSafe(job.partCount * sizeof(OutputBuffer *));
+    memset(job.parts, 0, job.partCount * sizeof(OutputBuffer *));
+
+    pthread_mutex_lock(&textMutex);
+    job.next = textJobs;
+    textJobs = &job;
+    pthread_cond_broadcast(&textPartsWaiting);
+    for (size_t part = 0; part < job.partCount; ++part) {
+        while (!job.parts[part]) {
+            if (job.nextPart < job.partCount && job.nextPart < job.writtenParts + job.partsAhead) {
+                size_t ownPart = job.nextPart++;
+                pthread_mutex_unlock(&textMutex);
+                OutputBuffer * buffer = formatTextPart(&job, ownPart);
+                pthread_mutex_lock(&textMutex);
+                job.parts[ownPart] = buffer;
+            }
+            else {
+                pthread_cond_wait(&textPartFormatted, &textMutex);
             }
         }
+        job.writtenParts = part + 1;
+        pthread_cond_broadcast(&textPartsWaiting);
+        pthread_mutex_unlock(&textMutex);
+
+        if (verbose && !((part * TEXT_PART_SIZE) & SCAN_DEBUG_MASK))
+            stdLog("Writing primes as text %02.2f%%", 100 * ((double) part)/((double) job.partCount));
+        writeOutputBuffer(file, job.parts[part]);
+
+        pthread_mutex_lock(&textMutex);
+    }
+    TextJob ** position = &textJobs;
+    while (*position != &job) position = &(*position)->next;
+    *position = job.next;
+    pthread_mutex_unlock(&textMutex);
+    free(job.parts);
+}
+
+
+
+static void writePrimeText(Prime from, Prime to, size_t range, unsigned char * bitmap, int file) {
+    Prime base;
+    getBitmapBase(base, from);
+
+    unsigned int skipped[3];
+    int skippedCount = getSkippedPrimes(from, to, skipped);
+    if (preallocateFiles) {
+        size_t textSize = skippedCount * 2;
+        size_t foundPrimes = skippedCount;
+        getPrimeStats(from, to, range, bitmap, &textSize, &foundPrimes);
+        preallocateOutput(file, textSize);
+    }
+    if (threadCount > 1) {
+        writePrimeTextInParts(base, to, range, bitmap, file, skipped, skippedCount);
+        finishOutput();
+        return;
+    }
+
+    OutputBuffer * writeBuffer = getOutputBuffer();
+    size_t remainingBuffer = WRITE_BUFFER_SIZE;
+    char * bufferWritePos = writeBuffer->data;
+    for (int i = 0; i < skippedCount; ++i) {
+        bufferWritePos[0] = '0' + skipped[i];
+        bufferWritePos[1] = '\n';
+        bufferWritePos += 2;
+        remainingBuffer -= 2;
+    }
+
+    // Every bit from "to" onwards has been cleared by process()
+    DecimalString decimal;
+    setDecimalString(&decimal, base);
+    size_t decimalOffset = 0;
+    unsigned short bits[BITMAP_BLOCK_SIZE * 8];
+    for (size_t blockStart = 0; blockStart < range; blockStart += BITMAP_BLOCK_SIZE) {
+        if (verbose && !(blockStart & SCAN_DEBUG_MASK)) 
+            stdLog("Writing primes as text %02.2f%%", 100 * ((double) blockStart)/((double) range));
+
+        size_t blockSize = range - blockStart;
+        if (blockSize > BITMAP_BLOCK_SIZE) blockSize = BITMAP_BLOCK_SIZE;
+        size_t count = getBitmapBits(bitmap + blockStart, blockSize, bits);
+        if (remainingBuffer < PRIME_STRING_SIZE * count) {
+            writeBuffer->size = WRITE_BUFFER_SIZE - remainingBuffer;
+            writeOutputBuffer(file, writeBuffer);
+            writeBuffer = getOutputBuffer();
+            bufferWritePos = writeBuffer->data;
+            remainingBuffer = WRITE_BUFFER_SIZE;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            size_t offset = (blockStart + (bits[i] >> 3)) * bitmapSpan + bitmapResidues[bits[i] & 7];
+            addToDecimalString(&decimal, offset - decimalOffset);
+            decimalOffset = offset;
+            size_t bytesWritten = copyDecimalString(bufferWritePos, &decimal);
+            bufferWritePos[bytesWritten] = '\n';
+            bufferWritePos += bytesWritten + 1;
+            remainingBuffer -= bytesWritten + 1;
+        }
+    }
+
+    writeBuffer->size = WRITE_BUFFER_SIZE - remainingBuffer;
+    writeOutputBuffer(file, writeBuffer);
+
+    finishOutput();
+}
+
+
+
+static void writePrimeSystemBinary(Prime from, Prime to, size_t range, unsigned char * bitmap, int file) {
+    Prime buffer[WRITE_BUFFER_SIZE / sizeof(Prime)];
+    size_t count = 0;
+    Prime base;
+    getBitmapBase(base, from);
+
+    unsigned int skipped[3];
+    int skippedCount = getSkippedPrimes(from, to, skipped);
+    if (preallocateFiles) preallocateOutput(file, (skippedCount + countBits(bitmap, range)) * sizeof(Prime));
+    for (int i = 0; i < skippedCount; ++i) {
+        prime_set_num(buffer[count], skipped[i]);
+        ++count;
+    }
+
+    // Every bit from "to" onwards has been cleared by process()
+    unsigned short bits[BITMAP_BLOCK_SIZE * 8];
+    for (size_t blockStart = 0; blockStart < range; blockStart += BITMAP_BLOCK_SIZE) {
+        if (verbose && !(blockStart & SCAN_DEBUG_MASK))
+            stdLog("Writing primes %02.2f%%", 100 * ((double) blockStart)/((double) range));
+
+        size_t blockSize = range - blockStart;
+        if (blockSize > BITMAP_BLOCK_SIZE) blockSize = BITMAP_BLOCK_SIZE;
+        size_t found = getBitmapBits(bitmap + blockStart, blockSize, bits);
+        if (count + found > WRITE_BUFFER_SIZE / sizeof(Prime)) {
+            writeOutput(file, buffer, count * sizeof(Prime));
+            count = 0;
+        }
+        for (size_t i = 0; i < found; ++i) {
+            size_t offset = (blockStart + (bits[i] >> 3)) * bitmapSpan + bitmapResidues[bits[i] & 7];
+            prime_set_num(buffer[count], offset);
+            prime_add_prime(buffer[count], buffer[count], base);
+            ++count;
+        }
+    }
+    
+    writeOutput(file, buffer, count * sizeof(Prime));
+    
+    finishOutput();
+}
+
+
+
+// Writes the from value of a file header.  For the odd only bitmap this is the (even) start of the bitmap
+// except that 3 is used if 2 has been excluded.
+static void getHeaderFrom(PrimeString fromString, Prime from) {
+    Prime tmp;
+    prime_set_num(tmp, 2);
+    if (!useWheel && prime_eq(from, tmp) && disallow2) strcpy(fromString, "3");
+    else prime_to_str(fromString, from);
+}
+
+
+
+static void writePrimeCompressedBinary(Prime from, Prime to, size_t range, unsigned char * bitmap, int file ) {
+    CompressedBinaryHeader header;
+    memset(&header, 0, sizeof(CompressedBinaryHeader));
+    snprintf(header.headerSize, sizeof(header.headerSize), "%zd", sizeof(CompressedBinaryHeader));
+    if (useWheel) {
+        snprintf(header.signature, sizeof(header.signature), COMPRESSED_BINARY_SIGNATURE_1_1);
+        snprintf(header.skip, sizeof(header.skip), COMPRESSED_BINARY_SKIP_WHEEL);
+    }
+    else {
+        snprintf(header.signature, sizeof(header.signature), COMPRESSED_BINARY_SIGNATURE);
+        snprintf(header.skip, sizeof(header.skip), COMPRESSED_BINARY_SKIP_ODD);
+    }
+    snprintf(header.dataBlockSize, sizeof(header.dataBlockSize), "%zd", range);
+    snprintf(header.fromToSize, sizeof(header.fromToSize), "%zd",sizeof(header.from));
+    snprintf(header.comments, sizeof(header.comments), "File Created on: %s\n\nCreated by...\n%s", timeNow(), getVersion());
+    
+    // Every skipped prime is a single digit
+    unsigned int skipped[3];
+    size_t foundPrimes = getSkippedPrimes(from, to, skipped);
+    size_t textSize = foundPrimes * 2;
+
+    PrimeString s;
+    getHeaderFrom(s, from);
+    snprintf(header.from, sizeof(header.from),"%s", s);
+    prime_to_str(s, to);
+    snprintf(header.to, sizeof(header.to), "%s",s);
+    
+    getPrimeStats(from, to, range, bitmap, &textSize, &foundPrimes);
+
+    snprintf(header.primeCount, sizeof(header.primeCount),"%zd", foundPrimes);
+    snprintf(header.textSize, sizeof(header.textSize),"%zd", textSize);
+    
+    preallocateOutput(file, sizeof(CompressedBinaryHeader) + range);
+    writeOutput(file, &header, sizeof(CompressedBinaryHeader));
+    writeOutput(file, bitmap, range);
+
+    finishOutput();
+}
+
+
+
+// Gap coding one chunk, see GapCodedHeader
+typedef struct GapEncoder {
+    unsigned char * restartIndex;
+    size_t restartCount;
+    OutputBuffer * first;     // The gaps
+    OutputBuffer * last;
+    size_t gapsSize;
+    size_t primeCount;        // Odd primes added so far
+    size_t previous;          // Offset of the last prime added
+} GapEncoder;
+
+
+
+static void addGapCodedPrime(GapEncoder * encoder, size_t offset) {
+    if (encoder->primeCount % GAP_RESTART_INTERVAL == 0) {
+        unsigned char * entry = encoder->restartIndex + (encoder->primeCount / GAP_RESTART_INTERVAL) * GAP_RESTART_ENTRY_SIZE;
+        putLittleEndian64(entry, offset);
+        putLittleEndian64(entry + 8, encoder->gapsSize);
+    }
+    else {
+        if (encoder->last->size + GAP_CODE_MAX_SIZE > WRITE_BUFFER_SIZE) {
+            encoder->last->next = getOutputBuffer();
+            encoder->last = encoder->last->next;
+        }
+        unsigned char * target = (unsigned char *) encoder->last->data + encoder->last->size;
+        size_t size = putGapCode(target, (offset - encoder->previous) / 2);
+        encoder->last->size += size;
+        encoder->gapsSize += size;
+    }
+    encoder->previous = offset;
+    ++encoder->primeCount;
+}
+
+
+
+static void writePrimeGapCoded(Prime from, Prime to, size_t range, unsigned char * bitmap, int file ) {
+    GapCodedHeader header;
+    memset(&header, 0, sizeof(GapCodedHeader));
+    snprintf(header.signature, sizeof(header.signature), GAP_CODED_SIGNATURE);
+    snprintf(header.headerSize, sizeof(header.headerSize), "%zd", sizeof(GapCodedHeader));
+    snprintf(header.fromToSize, sizeof(header.fromToSize), "%zd", sizeof(header.from));
+    snprintf(header.restartInterval, sizeof(header.restartInterval), "%d", GAP_RESTART_INTERVAL);
+    snprintf(header.comments, sizeof(header.comments), "File Created on: %s\n\nCreated by...\n%s", timeNow(), getVersion());
+
+    // Every skipped prime is a single digit
+    unsigned int skipped[3];
+    int skippedCount = getSkippedPrimes(from, to, skipped);
+    size_t foundPrimes = skippedCount;
+    size_t textSize = foundPrimes * 2;
+    getPrimeStats(from, to, range, bitmap, &textSize, &foundPrimes);
+
+    PrimeString s;
+    getHeaderFrom(s, from);
+    snprintf(header.from, sizeof(header.from),"%s", s);
+    Prime headerFrom;
+    str_to_prime(headerFrom, s);
+    prime_to_str(s, to);
+    snprintf(header.to, sizeof(header.to), "%s",s);
+    snprintf(header.primeCount, sizeof(header.primeCount),"%zd", foundPrimes);
+    snprintf(header.textSize, sizeof(header.textSize),"%zd", textSize);
+
+    // Offsets are from the bitmap's base until they are written
+    Prime base, tmp;
+    getBitmapBase(base, from);
+    prime_sub_prime(tmp, headerFrom, base);
+    size_t fromOffset = prime_get_num(tmp);
+
+    GapEncoder encoder;
+    size_t oddPrimes = foundPrimes - (skippedCount && skipped[0] == 2);
+    encoder.restartCount = (oddPrimes + GAP_RESTART_INTERVAL - 1) / GAP_RESTART_INTERVAL;
+    encoder.restartIndex = mallocSafe(encoder.restartCount * GAP_RESTART_ENTRY_SIZE + 1);
+    encoder.first = getOutputBuffer();
+    encoder.last = encoder.first;
+    encoder.gapsSize = 0;
+    encoder.primeCount = 0;
+    encoder.previous = 0;
+
+    // The skipped primes come before everything in the bitmap, which starts at 0 if they are in range
+    for (int i = 0; i < skippedCount; ++i) {
+        if (skipped[i] != 2) addGapCodedPrime(&encoder, skipped[i] - fromOffset);
+    }
+
+    // Every bit from "to" onwards has been cleared by process()
+    unsigned short bits[BITMAP_BLOCK_SIZE * 8];
+    for (size_t blockStart = 0; blockStart < range; blockStart += BITMAP_BLOCK_SIZE) {
+        if (verbose && !(blockStart & SCAN_DEBUG_MASK))
+            stdLog("Writing prime gaps %02.2f%%", 100 * ((double) blockStart)/((double) range));
+
+        size_t blockSize = range - blockStart;
+        if (blockSize > BITMAP_BLOCK_SIZE) blockSize = BITMAP_BLOCK_SIZE;
+        size_t count = getBitmapBits(bitmap + blockStart, blockSize, bits);
+        for (size_t i = 0; i < count; ++i) {
+            size_t offset = (blockStart + (bits[i] >> 3)) * bitmapSpan + bitmapResidues[bits[i] & 7];
+            addGapCodedPrime(&encoder, offset - fromOffset);
+        }
     }
-    *retTextSize = textSize;
-    *retFoundPrimes = foundPrimes;
+    if (encoder.primeCount != oddPrimes) exitError(1, 0, "Gap coding found %zd primes, expected %zd",
+            encoder.primeCount, oddPrimes);
+
+    size_t indexSize = encoder.restartCount * GAP_RESTART_ENTRY_SIZE;
+    snprintf(header.restartCount, sizeof(header.restartCount), "%zd", encoder.restartCount);
+    snprintf(header.gapsSize, sizeof(header.gapsSize), "%zd", encoder.gapsSize);
+    snprintf(header.dataBlockSize, sizeof(header.dataBlockSize), "%zd", indexSize + encoder.gapsSize);
+
+    preallocateOutput(file, sizeof(GapCodedHeader) + indexSize + encoder.gapsSize);
+    writeOutput(file, &header, sizeof(GapCodedHeader));
+    writeOutput(file, encoder.restartIndex, indexSize);
+    free(encoder.restartIndex);
+    while (encoder.first) {
+        OutputBuffer * buffer = encoder.first;
+        encoder.first = buffer->next;
+        writeOutputBuffer(file, buffer);
+    }
+
+    finishOutput();
 }
 
 
 
-static void writeSafe(int file, const void * buffer, size_t size) {
-    if (write(file, buffer, size) != size) exitError(1, errno, "Failed to write prime file");
+static void writePrimeStatsOnly(Prime from, Prime to, size_t range, unsigned char * bitmap, int file ) {
+
+    unsigned int skipped[3];
+    size_t foundPrimes = getSkippedPrimes(from, to, skipped);
+    size_t textSize = foundPrimes * 2;
+
+    PrimeString fromString;
+    getHeaderFrom(fromString, from);
+    PrimeString toString;
+    prime_to_str(toString, to);
+
+    getPrimeStats(from, to, range, bitmap, &textSize, &foundPrimes);
+
+    char buffer[PRIME_STRING_SIZE * 6];
+    int bytesWritten = snprintf(buffer, PRIME_STRING_SIZE * 6, "From: %s To: %s Primes: %zd TextSize: %zd\n",
+            fromString, toString, foundPrimes, textSize);
+    if (bytesWritten >= PRIME_STRING_SIZE * 6 ) exitError(1, 0, "Output buffer overflow");
+
+    writeOutput(file, buffer, bytesWritten);
+
+    finishOutput();
 }
 
 
 
-static void writePrimeText(Prime from, Prime to, size_t range, unsigned char * bitmap, int file) {
-    char writeBuffer[WRITE_BUFFER_SIZE];
-    size_t remainingBuffer = WRITE_BUFFER_SIZE;
-    char * bufferWritePos = writeBuffer;
+// Maps an init file written by saveInitFile() straight into memory as primes[]
+static void mapInitFile(unsigned char * map, size_t fileSize, Prime * covered) {
+    InitFileHeader header;
+    memcpy(&header, map, sizeof(InitFileHeader));
+    forceNullTerminate(header.headerSize);
+    forceNullTerminate(header.primeSize);
+    forceNullTerminate(header.byteOrder);
+    forceNullTerminate(header.primeCount);
+    forceNullTerminate(header.maxPrime);
+
+    size_t headerSize, primeSize, count;
+    if (sscanf(header.headerSize, "%zu", &headerSize) != 1 || headerSize < sizeof(InitFileHeader)
+            || headerSize % sizeof(SievePrime))
+        exitError(1, 0, "Init file %s has an invalid header size: %s", initFileName, header.headerSize);
+    if (sscanf(header.primeSize, "%zu", &primeSize) != 1 || primeSize != sizeof(SievePrime))
+        exitError(1, 0, "Init file %s holds %s byte primes, this program needs %zd", initFileName,
+                header.primeSize, sizeof(SievePrime));
+    if (strcmp(header.byteOrder, INIT_FILE_BYTE_ORDER))
+        exitError(1, 0, "Init file %s is %s endian, this system is %s endian", initFileName,
+                header.byteOrder, INIT_FILE_BYTE_ORDER);
+    if (sscanf(header.primeCount, "%zu", &count) != 1 || count > (fileSize - headerSize) / sizeof(SievePrime))
+        exitError(1, 0, "Init file %s is truncated, expected %s primes", initFileName, header.primeCount);
+    str_to_prime(*covered, header.maxPrime);
+
+    primes = (SievePrime *) (map + headerSize);
+    primeCount = count;
+}
 
-    Prime prime_2;
-    prime_set_num(prime_2, 2);
-    if (prime_le(from, prime_2) && prime_ge(to, prime_2) && !disallow2) {
-        bufferWritePos[0] = '2';
-        bufferWritePos[1] = '\n';
-        bufferWritePos += 2;
-        remainingBuffer -= 2;
-    }
-    size_t endRange = range -1;
 
-    int threadNum;
-    if (singleFile && threadCount > 1) {
-        threadNum = (*((int*)pthread_getspecific(threadNumKey))) -1;
-        sem_wait(&threads[threadNum].writeSemaphore);
+
+// Reads primes written by -b (or -I), these must start at 2 or 3
+static void readBinaryInitFile(const unsigned char * map, size_t fileSize, Prime * covered) {
+    if (fileSize % sizeof(Prime)) 
+        exitError(1, 0, "Init file %s is not a whole number of %zd byte primes", initFileName, sizeof(Prime));
+    const Prime * values = (const Prime *) map;
+    size_t count = fileSize / sizeof(Prime);
+    size_t first = 0;
+    if (prime_get_num(values[0]) == 2) ++first;
+    Prime prime_3;
+    prime_set_num(prime_3, 3);
+    if (first == count || !prime_eq(values[first], prime_3))
+        exitError(1, 0, "Init file %s must start at 3", initFileName);
+
+    primes = mallocSafe((count - first + 1) * sizeof(SievePrime));
+    primeCount = 0;
+    for (size_t i = first; i < count && prime_le(values[i], maxSievingPrime); ++i) {
+        primes[primeCount++] = prime_get_num(values[i]);
     }
+    prime_cp(*covered, values[count - 1]);
+}
 
-    for (size_t i = 0; i < endRange; ++i) {
-        if (verbose && !(i & SCAN_DEBUG_MASK)) 
-            stdLog("Writing primes as text %02.2f%%", 100 * ((double) i)/((double) range));
 
-        if (bitmap[i]) {
-            if (remainingBuffer < PRIME_STRING_SIZE * bitCount[bitmap[i]]) {
-                writeSafe(file, writeBuffer, WRITE_BUFFER_SIZE - remainingBuffer);
-                bufferWritePos = writeBuffer;
-                remainingBuffer = WRITE_BUFFER_SIZE;
-            }
-            for (int j = 1; j < 16; j+=2) {
-                if (bitmap[i] & checkMask[j]) {
-                    Prime value;
-                    getPrimeFromMap(value, from, i, j);
-                    int bytesWritten = prime_to_str(bufferWritePos, value);
-                    bufferWritePos[bytesWritten] = '\n';
-                    bufferWritePos += bytesWritten + 1;
-                    remainingBuffer -= bytesWritten + 1;
+
+// Reads primes from -B files, these must start at 3 or below with each block starting where the last ended
+static void readCompressedInitFile(const unsigned char * map, size_t fileSize, Prime * covered) {
+    size_t allocated = 0;
+    primes = NULL;
+    primeCount = 0;
+
+    Prime from, to, base, value;
+    prime_set_num(to, 3);
+    size_t position = 0;
+    int finished = 0;
+    while (!finished && position + sizeof(CompressedBinaryHeader) <= fileSize) {
+        CompressedBinaryHeader header;
+        memcpy(&header, map + position, sizeof(CompressedBinaryHeader));
+        forceNullTerminate(header.signature);
+        forceNullTerminate(header.headerSize);
+        forceNullTerminate(header.dataBlockSize);
+        forceNullTerminate(header.skip);
+        forceNullTerminate(header.from);
+        forceNullTerminate(header.to);
+
+        int version_1_1 = !strcmp(COMPRESSED_BINARY_SIGNATURE_1_1, header.signature);
+        if (strcmp(COMPRESSED_BINARY_SIGNATURE, header.signature) && !version_1_1)
+            exitError(1, 0, "Init file %s has an invalid block header: %s", initFileName, header.signature);
+        int wheel = version_1_1 && !strcmp(COMPRESSED_BINARY_SKIP_WHEEL, header.skip);
+        if (!wheel && strcmp(COMPRESSED_BINARY_SKIP_ODD, header.skip))
+            exitError(1, 0, "Init file %s has an invalid skip value: %s", initFileName, header.skip);
+        size_t headerSize, blockSize;
+        if (sscanf(header.headerSize, "%zu", &headerSize) != 1 || headerSize != sizeof(CompressedBinaryHeader))
+            exitError(1, 0, "Init file %s has an invalid header size: %s", initFileName, header.headerSize);
+        if (sscanf(header.dataBlockSize, "%zu", &blockSize) != 1
+                || blockSize > fileSize - position - headerSize)
+            exitError(1, 0, "Init file %s is truncated", initFileName);
+
+        // Each block must carry on from the last, the first must include 3
+        str_to_prime(from, header.from);
+        if (prime_gt(from, to)) {
+            PrimeString toString;
+            prime_to_str(toString, to);
+            exitError(1, 0, "Init file %s is missing primes from %s to %s", initFileName, toString, header.from);
+        }
+        str_to_prime(to, header.to);
+
+        // The odd bitmap starts on the even number at or below from, the wheel on a multiple of 30
+        int span = wheel ? WHEEL_SPAN : ODD_SPAN;
+        const unsigned char * residues = wheel ? wheelResidues : oddResidues;
+        prime_mod_num(base, from, wheel ? WHEEL_SPAN : 2);
+        prime_sub_prime(base, from, base);
+        if (wheel) {
+            // 3 and 5 are not in the bitmap
+            for (unsigned int skipped = 3; skipped <= 5; skipped += 2) {
+                prime_set_num(value, skipped);
+                if (prime_le(from, value) && prime_lt(value, to)) {
+                    if (primeCount == allocated) {
+                        allocated += INIT_FILE_ALLOC_UNIT;
+                        primes = reallocSafe(primes, allocated * sizeof(SievePrime));
+                    }
+                    primes[primeCount++] = skipped;
                 }
             }
         }
-    }
 
-    if (bitmap[endRange]) {
-       if (remainingBuffer < PRIME_STRING_SIZE * bitCount[bitmap[endRange]]) {
-            writeSafe(file, writeBuffer, WRITE_BUFFER_SIZE - remainingBuffer);
-            bufferWritePos = writeBuffer;
-            remainingBuffer = WRITE_BUFFER_SIZE;
-        }
-        for (int j = 1; j < 16; j+=2) {
-            if (bitmap[endRange] & checkMask[j]) {
-                Prime value;
-                getPrimeFromMap(value, from, endRange, j);
-                if (prime_lt(value, to)) {
-                    int bytesWritten = prime_to_str(bufferWritePos, value);
-                    bufferWritePos[bytesWritten] = '\n';
-                    bufferWritePos += bytesWritten + 1;
-                    remainingBuffer -= bytesWritten + 1;
+        const unsigned char * bitmap = map + position + headerSize;
+        unsigned short bits[BITMAP_BLOCK_SIZE * 8];
+        for (size_t blockStart = 0; !finished && blockStart < blockSize; blockStart += BITMAP_BLOCK_SIZE) {
+            size_t size = blockSize - blockStart;
+            if (size > BITMAP_BLOCK_SIZE) size = BITMAP_BLOCK_SIZE;
+            size_t count = getBitmapBits(bitmap + blockStart, size, bits);
+            if (primeCount + count > allocated) {
+                allocated += INIT_FILE_ALLOC_UNIT;
+                primes = reallocSafe(primes, allocated * sizeof(SievePrime));
+            }
+            for (size_t i = 0; i < count; ++i) {
+                getPrimeFromBitmap(value, base, blockStart + (bits[i] >> 3), bits[i] & 7, span, residues);
+                if (prime_lt(value, from) || prime_get_num(value) < 3) continue;
+                if (!prime_lt(value, to) || prime_gt(value, maxSievingPrime)) {
+                    finished = 1;
+                    break;
                 }
+                primes[primeCount++] = prime_get_num(value);
             }
         }
+        position += headerSize + blockSize;
     }
-
-    writeSafe(file, writeBuffer, WRITE_BUFFER_SIZE - remainingBuffer);
-
-    if (singleFile && threadCount > 1) {
-        sem_post(threads[threadNum].nextThreadWriteSemaphore);
-    }
+    if (!primeCount) exitError(1, 0, "Init file %s contains no primes", initFileName);
+    prime_sub_num(*covered, to, 1);
 }
 
 
 
-static void writePrimeSystemBinary(Prime from, Prime to, size_t range, unsigned char * bitmap, int file) {
-    Prime buffer[WRITE_BUFFER_SIZE / sizeof(Prime)];
-    int count = 0;
-
-    prime_set_num(buffer[0], 2);
-    if (prime_le(from, buffer[0]) && prime_ge(to, buffer[0]) && !disallow2) {
-        count = 1;
-    }
-    size_t endRange = range -1;
-
-    int threadNum;
-    if (singleFile && threadCount > 1) {
-        threadNum = (*((int*)pthread_getspecific(threadNumKey))) -1;
-        sem_wait(&threads[threadNum].writeSemaphore);
-    }
-
-    for (size_t i = 0; i < endRange; ++i) {
-        if (!(i & SCAN_DEBUG_MASK)) {
-            if (verbose) stdLog("Writing primes %02.2f%%", 100 * ((double) i)/((double) range));
+// Reads primes from -g files, these must start at 3 or below with each block starting where the last ended
+static void readGapCodedInitFile(const unsigned char * map, size_t fileSize, Prime * covered) {
+    size_t allocated = 0;
+    primes = NULL;
+    primeCount = 0;
+
+    Prime from, to, value;
+    prime_set_num(to, 3);
+    size_t position = 0;
+    int finished = 0;
+    while (!finished && position + sizeof(GapCodedHeader) <= fileSize) {
+        GapCodedHeader header;
+        memcpy(&header, map + position, sizeof(GapCodedHeader));
+        forceNullTerminate(header.signature);
+        forceNullTerminate(header.headerSize);
+        forceNullTerminate(header.dataBlockSize);
+        forceNullTerminate(header.restartCount);
+        forceNullTerminate(header.gapsSize);
+        forceNullTerminate(header.from);
+        forceNullTerminate(header.to);
+
+        if (strcmp(GAP_CODED_SIGNATURE, header.signature))
+            exitError(1, 0, "Init file %s has an invalid block header: %s", initFileName, header.signature);
+        size_t headerSize, blockSize, restartCount, gapsSize;
+        if (sscanf(header.headerSize, "%zu", &headerSize) != 1 || headerSize != sizeof(GapCodedHeader))
+            exitError(1, 0, "Init file %s has an invalid header size: %s", initFileName, header.headerSize);
+        if (sscanf(header.dataBlockSize, "%zu", &blockSize) != 1
+                || blockSize > fileSize - position - headerSize)
+            exitError(1, 0, "Init file %s is truncated", initFileName);
+        if (sscanf(header.restartCount, "%zu", &restartCount) != 1 || sscanf(header.gapsSize, "%zu", &gapsSize) != 1
+                || restartCount > blockSize / GAP_RESTART_ENTRY_SIZE
+                || blockSize != restartCount * GAP_RESTART_ENTRY_SIZE + gapsSize)
+            exitError(1, 0, "Init file %s has an invalid restart index", initFileName);
+
+        // Each block must carry on from the last, the first must include 3
+        str_to_prime(from, header.from);
+        if (prime_gt(from, to)) {
+            PrimeString toString;
+            prime_to_str(toString, to);
+            exitError(1, 0, "Init file %s is missing primes from %s to %s", initFileName, toString, header.from);
         }
-        if (bitmap[i]) {
-            if (count + bitCount[bitmap[i]] > WRITE_BUFFER_SIZE / sizeof(Prime)) {
-                writeSafe(file, buffer, count * sizeof(Prime));
-                count = 0;
+        str_to_prime(to, header.to);
+
+        // Each restart prime is only in the index, the gaps give the primes after it up to the next
+        const unsigned char * restartIndex = map + position + headerSize;
+        const unsigned char * gaps = restartIndex + restartCount * GAP_RESTART_ENTRY_SIZE;
+        const unsigned char * gap = gaps;
+        uint64_t previous = 0;
+        for (size_t restart = 0; !finished && restart < restartCount; ++restart) {
+            const unsigned char * entry = restartIndex + restart * GAP_RESTART_ENTRY_SIZE;
+            uint64_t offset = getLittleEndian64(entry);
+            if (gaps + getLittleEndian64(entry + 8) != gap || (restart && offset <= previous))
+                exitError(1, 0, "Init file %s has an invalid restart index", initFileName);
+            const unsigned char * runEnd = gaps + gapsSize;
+            uint64_t runLimit = UINT64_MAX;
+            if (restart + 1 < restartCount) {
+                uint64_t next = getLittleEndian64(entry + GAP_RESTART_ENTRY_SIZE + 8);
+                if (next > gapsSize) exitError(1, 0, "Init file %s has an invalid restart index", initFileName);
+                runEnd = gaps + next;
+                runLimit = getLittleEndian64(entry + GAP_RESTART_ENTRY_SIZE);
             }
-            for (int j = 1; j < 16; j+=2) {
-                if (bitmap[i] & checkMask[j]) {
-                    getPrimeFromMap(buffer[count], from, i, j);
-                    ++count;
+
+            while (1) {
+                if (offset >= runLimit)
+                    exitError(1, 0, "Init file %s has gaps which do not match its restart index", initFileName);
+                prime_add_num(value, from, offset);
+                if (!prime_lt(value, to) || prime_gt(value, maxSievingPrime)) {
+                    finished = 1;
+                    break;
                 }
+                if (primeCount == allocated) {
+                    allocated += INIT_FILE_ALLOC_UNIT;
+                    primes = reallocSafe(primes, allocated * sizeof(SievePrime));
+                }
+                primes[primeCount++] = prime_get_num(value);
+                previous = offset;
+
+                if (gap >= runEnd) break;
+                uint64_t halfGap = *(gap++);
+                if (!halfGap) {
+                    unsigned char byte;
+                    int shift = 0;
+                    do {
+                        if (gap >= runEnd || shift > 63)
+                            exitError(1, 0, "Init file %s has an invalid gap", initFileName);
+                        byte = *(gap++);
+                        halfGap |= ((uint64_t) (byte & 0x7F)) << shift;
+                        shift += 7;
+                    } while (byte & 0x80);
+                    if (!halfGap) exitError(1, 0, "Init file %s has an invalid gap", initFileName);
+                }
+                offset += halfGap * 2;
             }
         }
+        if (!finished && gap != gaps + gapsSize)
+            exitError(1, 0, "Init file %s has gaps after its last restart point", initFileName);
+        position += headerSize + blockSize;
     }
-    if (bitmap[endRange]) {
-        if (count + bitCount[bitmap[endRange]] >= WRITE_BUFFER_SIZE / sizeof(Prime)) {
-            writeSafe(file, buffer, count * sizeof(Prime));
-            count = 0;
-        }
-        for (int j = 1; j < 16; j+=2) {
-            if (bitmap[endRange] & checkMask[j]) {
-                getPrimeFromMap(buffer[count], from, endRange, j);
-                if (prime_lt(buffer[count], to)) ++count;
-            }
-        }
-    }
-    
-    writeSafe(file, buffer, count * sizeof(Prime));
-    
-    if (singleFile && threadCount > 1) {
-        sem_post(threads[threadNum].nextThreadWriteSemaphore);
-    }
+    if (!primeCount) exitError(1, 0, "Init file %s contains no primes", initFileName);
+    prime_sub_num(*covered, to, 1);
 }
 
 
 
-static void writePrimeCompressedBinary(Prime from, Prime to, size_t range, unsigned char * bitmap, int file ) {
-    CompressedBinaryHeader header;
-    memset(&header, 0, sizeof(CompressedBinaryHeader));
-    snprintf(header.headerSize, sizeof(header.headerSize), "%zd", sizeof(CompressedBinaryHeader));
-    snprintf(header.signature, sizeof(header.signature), "Compressed Prime Binary: 1.0");
-    snprintf(header.dataBlockSize, sizeof(header.dataBlockSize), "%zd", range);
-    snprintf(header.skip, sizeof(header.skip), "2");
-    snprintf(header.fromToSize, sizeof(header.fromToSize), "%zd",sizeof(header.from));
-    snprintf(header.comments, sizeof(header.comments), "File Created on: %s\n\nCreated by...\n%s", timeNow(), getVersion());
-    
-    size_t foundPrimes = 0;
-    size_t textSize = 0;
-
-    Prime tmp;
-    prime_set_num(tmp, 2);
-    PrimeString s;
-    if (prime_eq(from, tmp)) {
-        if (disallow2) {
-            strcpy(s, "3");
+// Loads primes[] from an init file instead of running self initialisation.
+// Init files written by -j are mapped directly, -b (or -I), -B and -g output is read into memory.
+static void loadInitFile() {
+    if (!silent) stdLog("Loading initialisation file %s", initFileName);
+    int file = open(initFileName, O_RDONLY);
+    if (file == -1) exitError(1, errno, "Could not open init file %s", initFileName);
+    struct stat fileStat;
+    if (fstat(file, &fileStat)) exitError(1, errno, "Could not read init file %s", initFileName);
+    size_t fileSize = fileStat.st_size;
+    if (!fileSize) exitError(1, 0, "Init file %s is empty", initFileName);
+    unsigned char * map = mmap(NULL, fileSize, PROT_READ, MAP_SHARED, file, 0);
+    if (map == MAP_FAILED) exitError(1, errno, "Could not map init file %s", initFileName);
+    close(file);
+
+    Prime covered;
+    if (fileSize >= sizeof(InitFileHeader) && !memcmp(map, INIT_FILE_SIGNATURE, sizeof(INIT_FILE_SIGNATURE))) {
+        mapInitFile(map, fileSize, &covered);
+        initFileMap = map;
+        initFileMapSize = fileSize;
+    }
+    else {
+        if (fileSize >= sizeof(CompressedBinaryHeader) && 
+                (!memcmp(map, COMPRESSED_BINARY_SIGNATURE, sizeof(COMPRESSED_BINARY_SIGNATURE)) ||
+                 !memcmp(map, COMPRESSED_BINARY_SIGNATURE_1_1, sizeof(COMPRESSED_BINARY_SIGNATURE_1_1)))) {
+            readCompressedInitFile(map, fileSize, &covered);
+        }
+        else if (fileSize >= sizeof(GapCodedHeader) && !memcmp(map, GAP_CODED_SIGNATURE, sizeof(GAP_CODED_SIGNATURE))) {
+            readGapCodedInitFile(map, fileSize, &covered);
         }
         else {
-            foundPrimes = 1;
-            textSize = 2;
-            strcpy(s, "2");
+            readBinaryInitFile(map, fileSize, &covered);
         }
+        munmap(map, fileSize);
     }
-    else {
-        prime_to_str(s, from);
-    }
-    snprintf(header.from, sizeof(header.from),"%s", s);
-    prime_to_str(s, to);
-    snprintf(header.to, sizeof(header.to), "%s",s);
-    
-    getPrimeStats(from, to, range, bitmap, &textSize, &foundPrimes);
 
-    snprintf(header.primeCount, sizeof(header.primeCount),"%zd", foundPrimes);
-    snprintf(header.textSize, sizeof(header.textSize),"%zd", textSize);
-    
-    int threadNum;
-    if (singleFile && threadCount > 1) {
-        threadNum = (*((int*)pthread_getspecific(threadNumKey))) -1;
-        sem_wait(&threads[threadNum].writeSemaphore);
+    if (prime_lt(covered, maxSievingPrime)) {
+        PrimeString coveredString, requiredString;
+        prime_to_str(coveredString, covered);
+        prime_to_str(requiredString, maxSievingPrime);
+        exitError(1, 0, "Init file %s only has primes up to %s, %s is needed", initFileName, coveredString, requiredString);
     }
 
-    writeSafe(file, &header, sizeof(CompressedBinaryHeader));
-    writeSafe(file, bitmap, range);
+    // Only the primes needed for endValue are used
+    Prime tmp;
+    prime_add_num(tmp, maxSievingPrime, 1);
+    primeCount = findPrimeIndex(tmp);
 
-    if (singleFile && threadCount > 1) {
-        sem_post(threads[threadNum].nextThreadWriteSemaphore);
-    }
+    if (!silent) stdLog("Prime array now full with %zd primes", primeCount);
 }
 
 
 
-static void writePrimeStatsOnly(Prime from, Prime to, size_t range, unsigned char * bitmap, int file ) {
+// Writes primes[] as an init file for -i
+static void saveInitFile() {
+    if (!silent) stdLog("Writing initialisation file %s", saveInitFileName);
+    int file = open(saveInitFileName, O_WRONLY | O_CREAT | ( allowClobber ? O_TRUNC : O_EXCL ), 0644);
+    if (file == -1) exitError(2, errno, "Could not create init file: %s", saveInitFileName);
+
+    PrimeString endString;
+    prime_to_str(endString, endValue);
+    InitFileHeader header;
+    memset(&header, 0, sizeof(InitFileHeader));
+    snprintf(header.signature, sizeof(header.signature), INIT_FILE_SIGNATURE);
+    snprintf(header.headerSize, sizeof(header.headerSize), "%zd", sizeof(InitFileHeader));
+    snprintf(header.primeSize, sizeof(header.primeSize), "%zd", sizeof(SievePrime));
+    snprintf(header.byteOrder, sizeof(header.byteOrder), INIT_FILE_BYTE_ORDER);
+    snprintf(header.primeCount, sizeof(header.primeCount), "%zd", primeCount);
+    snprintf(header.comments, sizeof(header.comments), "Sieving primes for prime numbers up to %s", endString);
+    prime_to_str(header.maxPrime, maxSievingPrime);
+
+    writeSafe(file, &header, sizeof(InitFileHeader));
+    writeSafe(file, primes, primeCount * sizeof(SievePrime));
+    if (close(file)) exitError(2, errno, "Could not write init file: %s", saveInitFileName);
+}
 
-    size_t foundPrimes = 0;
-    size_t textSize = 0;
 
-    Prime tmp;
-    prime_set_num(tmp, 2);
-    PrimeString fromString;
-    if (prime_eq(from, tmp)) {
-        if (disallow2) {
-            strcpy(fromString, "3");
-        }
-        else {
-            foundPrimes = 1;
-            textSize = 2;
-            strcpy(fromString, "2");
-        }
+
+// Each thread sieves all of its chunks in one bitmap, allocated when the thread processes its first chunk.
+// It is sized for the largest chunk and faulted in up front so no chunk pays for fresh zeroed pages.
+static unsigned char * getThreadBitmap(ThreadDescriptor * thread) {
+    if (!thread->bitmap) {
+        Prime span;
+        prime_sub_prime(span, endValue, startValue);
+        if (prime_gt(span, chunkSize)) prime_cp(span, chunkSize);
+
+        // Chunks may start from an earlier even number or multiple of 30
+        if (useWheel) thread->bitmapSize = (prime_get_num(span) + 2 * WHEEL_SPAN - 2) / WHEEL_SPAN;
+        else thread->bitmapSize = (prime_get_num(span) + 16) / 16;
+        if (verbose) stdLog("Allocating %zd bytes for this thread's bitmap", thread->bitmapSize);
+        thread->bitmap = allocateLarge(thread->bitmapSize, 1);
     }
-    else {
-        prime_to_str(fromString, from);
+    return thread->bitmap;
+}
+
+
+
+// The equivalent of process() for bitmaps on the mod 30 wheel (see --wheel)
+static void processWheel(ThreadDescriptor * thread, Prime from, Prime to, int file) {
+    const SievePrime * primes = thread->primes;
+    Prime tmp;
+
+    Prime prime_2;
+    prime_set_num(prime_2, 2);
+    if (prime_lt(from, prime_2)) prime_set_num(from, 2);
+
+    Prime base;
+    getBitmapBase(base, from);
+    prime_sub_prime(tmp, to, base);
+    size_t range = (prime_get_num(tmp) + WHEEL_SPAN - 1) / WHEEL_SPAN;
+    if (verbose) stdLog("Bitmap will contain %zd bytes", range);
+
+    unsigned char * bitmap = getThreadBitmap(thread);
+
+    size_t patternOffsets[PRESIEVE_MAX_PATTERNS];
+    getPatternOffsets(base, patternOffsets);
+
+    size_t mapBits = range * WHEEL_SPAN;
+    size_t segmentPrimeCount = segmentPrimeEnd - lowPrimeCount;
+    size_t * segmentOffsets = thread->primeOffsets;
+    unsigned char * segmentWheelPositions = thread->segmentWheelPositions;
+    Prime prime;
+    for (size_t i = 0; i < segmentPrimeCount; ++i) {
+        prime_set_num(prime, primes[lowPrimeCount + i]);
+        segmentOffsets[i] = firstWheelMultipleOffset(prime, base, mapBits, &segmentWheelPositions[i]);
     }
-    PrimeString toString;
-    prime_to_str(toString, to);
+    for (size_t segmentStart = 0; segmentStart < range; segmentStart += SEGMENT_SIZE) {
+        size_t segmentSize = range - segmentStart;
+        if (segmentSize > SEGMENT_SIZE) segmentSize = SEGMENT_SIZE;
 
-    getPrimeStats(from, to, range, bitmap, &textSize, &foundPrimes);
+        preSieve(thread->preSievePatterns, bitmap + segmentStart, segmentSize, patternOffsets);
 
-    char buffer[PRIME_STRING_SIZE * 6];
-    int bytesWritten = snprintf(buffer, PRIME_STRING_SIZE * 6, "From: %s To: %s Primes: %zd TextSize: %zd\n",
-            fromString, toString, foundPrimes, textSize);
-    if (bytesWritten >= PRIME_STRING_SIZE * 6 ) exitError(1, 0, "Output buffer overflow");
+        size_t segmentBits = (segmentStart + segmentSize) * WHEEL_SPAN;
+        for (size_t i = 0; i < segmentPrimeCount; ++i) {
+            segmentOffsets[i] = crossWheelMultiples(bitmap, primes[lowPrimeCount + i],
+                segmentOffsets[i], &segmentWheelPositions[i], segmentBits);
+        }
+    }
 
-    int threadNum;
-    if (singleFile && threadCount > 1) {
-        threadNum = (*((int*)pthread_getspecific(threadNumKey))) -1;
-        sem_wait(&threads[threadNum].writeSemaphore);
+    // Primes with a square at or beyond "to" have nothing to remove from this chunk
+    size_t primeEnd = findSquareIndex(to);
+    for (size_t i = segmentPrimeEnd; i < primeEnd; ++i) {
+        if (verbose) {
+            if (!(i & APPLY_DEBUG_MASK)) {
+                stdLog("Calculating primes %02.2f%% (%zd of %zd [%zd])", 
+                    100 * ((double)i) / ((double)primeCount),i+1, primeCount, (size_t) primes[i]);
+            }
+        }
+        prime_set_num(prime, primes[i]);
+        applyWheelPrime(prime, base, bitmap, range);
+    }
+
+    // The pre-sieve removes the low primes themselves
+    for (size_t i = 2; i < lowPrimeCount; ++i) {
+        prime_set_num(prime, primes[i]);
+        if (prime_ge(prime, from) && prime_lt(prime, to)) {
+            prime_sub_prime(tmp, prime, base);
+            size_t offset = prime_get_num(tmp);
+            bitmap[offset / WHEEL_SPAN] |= ~wheelRemoveMask[offset % WHEEL_SPAN];
+        }
     }
 
-    writeSafe(file, buffer, bytesWritten);
+    // The bitmap starts below from (and 1 is not a prime)
+    for (int j = 0; j < 8; ++j) {
+        getPrimeFromBitmap(tmp, base, 0, j, WHEEL_SPAN, wheelResidues);
+        if (prime_lt(tmp, from)) bitmap[0] &= ~(1 << j);
+    }
 
-    if (singleFile && threadCount > 1) {
-        sem_post(threads[threadNum].nextThreadWriteSemaphore);
+    // Likewise everything from "to" onwards
+    for (int j = 0; j < 8; ++j) {
+        getPrimeFromBitmap(tmp, base, range - 1, j, WHEEL_SPAN, wheelResidues);
+        if (prime_ge(tmp, to)) bitmap[range - 1] &= ~(1 << j);
     }
+
+    writePrime(from, to, range, bitmap, file);
 }
 
 
 
-static void process(Prime from, Prime to, int file) {
+static void process(ThreadDescriptor * thread, size_t chunkNum, Prime from, Prime to, int file) {
+    // Sieving reads the copy of primes[] on this thread's NUMA node if there is one
+    const SievePrime * primes = thread->primes;
     Prime tmp;
 
     if (!silent) {
@@ -627,6 +2846,11 @@ static void process(Prime from, Prime to, int file) {
         stdLog("Running process for %s (inc) to %s (ex)", fromString, toString);
     }
 
+    if (useWheel) {
+        processWheel(thread, from, to, file);
+        return;
+    }
+
     Prime prime_2;
     prime_set_num(prime_2, 2);
     if (prime_lt(from, prime_2)) {
@@ -649,44 +2873,10 @@ static void process(Prime from, Prime to, int file) {
     size_t range = (prime_get_num(tmp) + 15) / 16;
     if (verbose) stdLog("Bitmap will contain %zd bytes", range);
 
-    unsigned char * bitmap = mallocSafe(range);
-
-    if (lowPrimeCount) {
-        //memset(bitmap, 0xFF, range);
-        // Theoretically we don't need to do two mods but we don't want to hit size limits 
-        // when we multiply.  So we do a mod first to bring down the size of "from"
-        prime_mod_prime(tmp, from, lowPrimeMapSize);
-        prime_mul_prime(tmp, tmp, lowPrimeMapMultiplyer);
-        prime_mod_prime(tmp, tmp, lowPrimeMapSize);
-        size_t lowPrimeMapOffset = prime_get_num(tmp);
-        size_t copySize = prime_get_num(lowPrimeMapSize); 
-        size_t firstCopySize = copySize - lowPrimeMapOffset;
-        char * currentMapPos = bitmap;
-        size_t sizeLeft = range;
-        if (verbose) {
-            stdLog("Using low prime map offset %zd", (size_t)prime_get_num(tmp));
-        }
-        if (sizeLeft > firstCopySize) {
-            memcpy(currentMapPos, lowPrimeMap + lowPrimeMapOffset, firstCopySize);
-            sizeLeft -= firstCopySize;
-            currentMapPos += firstCopySize;
-            while (sizeLeft >= copySize) {
-                memcpy(currentMapPos, lowPrimeMap, copySize);
-                sizeLeft -= copySize;
-                currentMapPos += copySize;
-            }
-            if (sizeLeft > 0) {
-                memcpy(currentMapPos, lowPrimeMap, sizeLeft);
-            }
-        }
-        else {
-            memcpy(currentMapPos, lowPrimeMap + lowPrimeMapOffset, sizeLeft);
-        }
-    }
-    else {
-        memset(bitmap, 0xFF, range);
-    }
+    unsigned char * bitmap = getThreadBitmap(thread);
 
+    size_t patternOffsets[PRESIEVE_MAX_PATTERNS];
+    getPatternOffsets(from, patternOffsets);
 
     if (verbose) {
         PrimeString fromString;
@@ -695,30 +2885,101 @@ static void process(Prime from, Prime to, int file) {
         prime_to_str(toString, to);
         stdLog("Calculating primes for range %s to %s", fromString, toString);
     }
-    // start with the first prime which is not a low prime
-    for (size_t i = lowPrimeCount; i < primeCount; ++i) {
+
+    // Small primes are applied one segment at a time, each segment being initialised
+    // by the pre-sieve just before it is used.
+    // Offsets carried from the thread's previous chunk are only recalculated if they are unknown.
+    // Crossing stops at "to" so the offsets left behind are the first multiples in the next chunk.
+    prime_sub_prime(tmp, to, from);
+    size_t mapBits = prime_get_num(tmp);
+    // Primes from primeEnd onwards have a square at or beyond "to" so have nothing to remove from this chunk.
+    // Those from squareStart have a square at or beyond "from" so their first multiple needs no division.
+    size_t primeEnd = findSquareIndex(to);
+    if (primeEnd < lowPrimeCount) primeEnd = lowPrimeCount;
+    size_t squareStart = findSquareIndex(from);
+    size_t kernelEnd = kernelPrimeEnd < primeEnd ? kernelPrimeEnd : primeEnd;
+    size_t segmentEnd = segmentPrimeEnd < primeEnd ? segmentPrimeEnd : primeEnd;
+    size_t carryEnd = carryPrimeEnd < primeEnd ? carryPrimeEnd : primeEnd;
+
+    // Buckets only hold primes for the thread's own chunks, not those taken from other threads
+    int useBuckets = thread->buckets && chunkNum % threadCount == thread->threadNum - 1;
+    size_t * primeOffsets = thread->primeOffsets;
+    int carried = carryStepMods && thread->carriedChunk == chunkNum;
+    Prime prime;
+    for (size_t i = 0; i < carryPrimeEnd - lowPrimeCount; ++i) {
+        if (!carried || primeOffsets[i] >= CARRY_UNKNOWN) {
+            if (lowPrimeCount + i < primeEnd) {
+                prime_set_num(prime, primes[lowPrimeCount + i]);
+                primeOffsets[i] = firstMultipleOffset(prime, from, CARRY_UNKNOWN);
+            }
+            else {
+                primeOffsets[i] = CARRY_UNKNOWN;
+            }
+        }
+    }
+    for (size_t segmentStart = 0; segmentStart < range; segmentStart += SEGMENT_SIZE) {
+        size_t segmentSize = range - segmentStart;
+        if (segmentSize > SEGMENT_SIZE) segmentSize = SEGMENT_SIZE;
+
+        preSieve(thread->preSievePatterns, bitmap + segmentStart, segmentSize, patternOffsets);
+
+        size_t segmentBits = (segmentStart + segmentSize) * 16;
+        if (segmentBits > mapBits) segmentBits = mapBits;
+        for (size_t i = 0; i < kernelEnd - lowPrimeCount; ++i) {
+            size_t prime = primes[lowPrimeCount + i];
+            primeOffsets[i] = crossKernels[prime & 0x0F](bitmap, primeOffsets[i], prime, segmentBits);
+        }
+        for (size_t i = kernelEnd - lowPrimeCount; i < segmentEnd - lowPrimeCount; ++i) {
+            size_t value = primeOffsets[i];
+            size_t stepSize = (size_t) primes[lowPrimeCount + i] * 2;
+            while (value < segmentBits) {
+                bitmap[value >> 4] &= removeMask[value & 0x0F];
+                value += stepSize;
+            }
+            primeOffsets[i] = value;
+        }
+    }
+
+    // Larger primes hit each segment no more than once so are applied to the whole bitmap in one go
+    for (size_t i = segmentPrimeEnd; i < carryEnd; ++i) {
+        size_t value = primeOffsets[i - lowPrimeCount];
+        size_t stepSize = (size_t) primes[i] * 2;
+        while (value < mapBits) {
+            bitmap[value >> 4] &= removeMask[value & 0x0F];
+            value += stepSize;
+        }
+        primeOffsets[i - lowPrimeCount] = value;
+    }
+    for (size_t i = carryPrimeEnd; i < primeEnd; ++i) {
+        if (i == bucketPrimeStart && useBuckets) i = bucketPrimeEnd;
+        if (i >= primeEnd) break;
         if (verbose) {
             if (!(i & APPLY_DEBUG_MASK)) {
-                PrimeString primeValueString;
-                prime_to_str(primeValueString, primes[i]);
-                stdLog("Calculating primes %02.2f%% (%zd of %zd [%s])", 
-                    100 * ((double)i) / ((double)primeCount),i+1, primeCount, primeValueString);
+                stdLog("Calculating primes %02.2f%% (%zd of %zd [%zd])", 
+                    100 * ((double)i) / ((double)primeCount),i+1, primeCount, (size_t) primes[i]);
             }
         }
-        applyPrime(primes[i], from, bitmap, range);
+        prime_set_num(prime, primes[i]);
+        if (i < squareStart) applyPrime(prime, from, bitmap, range);
+        else applyPrimeFromSquare(prime, from, bitmap, range);
     }
 
-    if (lowPrimeCount) {
-        size_t currentLowPrime = lowPrimeCount;
-        while (currentLowPrime > 0 && prime_ge(primes[currentLowPrime-1],from)) {
-            Prime v1, v2;
-            prime_sub_prime(v1, primes[currentLowPrime-1], from);
-            prime_div_16(v2, v1);
-            bitmap[prime_get_num(v2)] |= checkMask[prime_get_num(v1) & 0x0F];
-            --currentLowPrime;
+    if (useBuckets) applyBuckets(thread, chunkNum, from, bitmap, range);
+    if (carryStepMods) carryOffsets(thread, chunkNum, from);
+
+    // The pre-sieve removes the low primes themselves
+    for (size_t i = 0; i < lowPrimeCount; ++i) {
+        prime_set_num(prime, primes[i]);
+        if (prime_ge(prime, from) && prime_lt(prime, to)) {
+            prime_sub_prime(tmp, prime, from);
+            size_t offset = prime_get_num(tmp);
+            bitmap[offset >> 4] |= checkMask[offset & 0x0F];
         }
     }
 
+    // Multiples beyond "to" were not crossed off so clear everything from "to" onwards
+    bitmap[range - 1] &= (1 << ((mapBits - (range - 1) * 16) / 2)) - 1;
+
     writePrime(from, to, range, bitmap, file);
     
     if (verbose) {
@@ -728,8 +2989,225 @@ static void process(Prime from, Prime to, int file) {
         prime_to_str(toString, to);	
         stdLog("All primes have now been discovered between %s (inc) and %s (ex)", fromString, toString);
     }
+}
+
+
+
+// Reads a list of cpus such as "0,2,4-7" into cpus (room for CPU_SETSIZE), returning how many or -1 if invalid
+static int parseCpuList(const char * list, int * cpus) {
+    int count = 0;
+    while (*list && *list != '\n') {
+        char * end;
+        long first = strtol(list, &end, 10);
+        if (end == list) return -1;
+        long last = first;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list) return -1;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) return -1;
+        for (long cpu = first; cpu <= last && count < CPU_SETSIZE; ++cpu) cpus[count++] = cpu;
+        list = end;
+        if (*list == ',') ++list;
+        else if (*list && *list != '\n') return -1;
+    }
+    return count;
+}
+
+
+
+// Reads the NUMA node of each cpu from sysfs.  Without it every cpu is taken to be on node 0.
+static void readNumaNodes() {
+    memset(cpuNodes, 0, sizeof(cpuNodes));
+    nodeCount = 1;
+    DIR * dir = opendir("/sys/devices/system/node");
+    if (!dir) return;
+    int cpus[CPU_SETSIZE];
+    struct dirent * entry;
+    while ((entry = readdir(dir))) {
+        int node;
+        char extra;
+        if (sscanf(entry->d_name, "node%d%c", &node, &extra) != 1 || node < 0) continue;
+        char path[300];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+        FILE * file = fopen(path, "r");
+        if (!file) continue;
+        char list[4096];
+        int count = fgets(list, sizeof(list), file) ? parseCpuList(list, cpus) : -1;
+        fclose(file);
+        for (int i = 0; i < count; ++i) cpuNodes[cpus[i]] = node;
+        if (node >= nodeCount) nodeCount = node + 1;
+    }
+    closedir(dir);
+}
+
+
+
+// Chooses a cpu for each thread from --affinity.
+// "compact" fills one NUMA node before the next, "scatter" deals threads out across the nodes in turn.
+// Anything else is a list of cpus, used in order.  If there are more threads than cpus the list is reused.
+static void setupAffinity() {
+    readNumaNodes();
+    int cpus[CPU_SETSIZE];
+    int cpuCount = 0;
+    if (!strcmp(affinity, "compact") || !strcmp(affinity, "scatter")) {
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed)) exitError(1, errno, "Could not read the available cpus");
+        for (int node = 0; node < nodeCount; ++node) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (CPU_ISSET(cpu, &allowed) && cpuNodes[cpu] == node) cpus[cpuCount++] = cpu;
+            }
+        }
+
+        if (!strcmp(affinity, "scatter")) {
+            // cpus is grouped by node, take the first of each node then the second and so on
+            int scattered[CPU_SETSIZE];
+            int scatteredCount = 0;
+            for (int rank = 0; scatteredCount < cpuCount; ++rank) {
+                for (int start = 0; start < cpuCount;) {
+                    int end = start;
+                    while (end < cpuCount && cpuNodes[cpus[end]] == cpuNodes[cpus[start]]) ++end;
+                    if (start + rank < end) scattered[scatteredCount++] = cpus[start + rank];
+                    start = end;
+                }
+            }
+            memcpy(cpus, scattered, cpuCount * sizeof(int));
+        }
+    }
+    else {
+        cpuCount = parseCpuList(affinity, cpus);
+    }
+    if (cpuCount <= 0) exitError(1, 0, "Invalid affinity %s, use compact, scatter or a list of cpus (eg: 0,2,4-7)", affinity);
+    if (cpuCount < threadCount && !silent) stdLog("Only %d cpus for %d threads, some threads will share a cpu", cpuCount, threadCount);
+
+    threadCpus = mallocSafe(threadCount * sizeof(int));
+    for (int i = 0; i < threadCount; ++i) threadCpus[i] = cpus[i % cpuCount];
+
+    if (replicateNuma) {
+        if (nodeCount > 1) {
+            nodeReplicas = mallocSafe(nodeCount * sizeof(NodeReplica));
+            memset(nodeReplicas, 0, nodeCount * sizeof(NodeReplica));
+        }
+        else if (!silent) {
+            stdLog("Only one NUMA node, the sieving primes will not be copied");
+        }
+    }
+}
+
+
+
+static void pinThread(ThreadDescriptor * thread) {
+    int cpu = threadCpus[thread->threadNum - 1];
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (error) logWarning(error, "Could not pin thread %d to cpu %d", thread->threadNum, cpu);
+    else if (verbose) stdLog("Pinned to cpu %d on NUMA node %d", cpu, cpuNodes[cpu]);
+}
+
+
+
+// Points the thread at its node's copy of primes[] and preSievePatterns[], the first thread on each node makes it.
+// The copy is written by a thread pinned to the node so the kernel gives it memory from that node (first touch).
+static void useNodeReplica(ThreadDescriptor * thread) {
+    int node = cpuNodes[threadCpus[thread->threadNum - 1]];
+    NodeReplica * replica = nodeReplicas + node;
+    pthread_mutex_lock(&replicaMutex);
+    if (!replica->primes) {
+        if (verbose) stdLog("Copying the sieving primes to NUMA node %d", node);
+        replica->primes = allocateLarge((primeCount + 1) * sizeof(SievePrime), 0);
+        memcpy(replica->primes, primes, primeCount * sizeof(SievePrime));
+        replica->preSievePatterns = mallocSafe((preSievePatternCount + 1) * sizeof(PreSievePattern));
+        for (int i = 0; i < preSievePatternCount; ++i) {
+            replica->preSievePatterns[i] = preSievePatterns[i];
+            replica->preSievePatterns[i].map = allocateLarge(preSievePatterns[i].size, 0);
+            memcpy(replica->preSievePatterns[i].map, preSievePatterns[i].map, preSievePatterns[i].size);
+        }
+    }
+    pthread_mutex_unlock(&replicaMutex);
+    thread->primes = replica->primes;
+    thread->preSievePatterns = replica->preSievePatterns;
+}
+
+
+
+// Chunks are numbered from 0 at startValue.  Every chunk but the first starts on a multiple of chunkSize.
+static void processChunk(ThreadDescriptor * thread, size_t chunkNum) {
+    Prime from, to;
+    prime_set_num(to, chunkNum + 1);
+    prime_mul_prime(to, to, chunkSize);
+    prime_add_prime(to, to, chunkOrigin);
+    if (prime_gt(to, endValue)) prime_cp(to, endValue);
+    if (chunkNum == 0) {
+        prime_cp(from, startValue);
+    }
+    else {
+        prime_set_num(from, chunkNum);
+        prime_mul_prime(from, from, chunkSize);
+        prime_add_prime(from, from, chunkOrigin);
+    }
+
+    thread->writeChunk = chunkNum;
+    if (singleFile) process(thread, chunkNum, from, to, theSingleFile);
+    else {
+        int file = openFileForPrime(from, to);
+        process(thread, chunkNum, from, to, file);
+        drainAsyncWrites(&thread->asyncWriter);
+        flushDirectWrites(&thread->directWriter);
+        closeFileForPrime(file);
+        endSplice(&thread->spliceWriter, &thread->spareBuffers);
+    }
+}
+
+
+
+// Each thread starts with its own chunks, every threadCount'th from threadNum - 1, and takes them in order.
+static int claimChunk(ThreadDescriptor * thread, size_t * chunkNum) {
+    pthread_mutex_lock(&thread->claimMutex);
+    int claimed = thread->nextChunk < thread->endChunk;
+    if (claimed) {
+        *chunkNum = thread->nextChunk;
+        thread->nextChunk += threadCount;
+    }
+    pthread_mutex_unlock(&thread->claimMutex);
+    return claimed;
+}
+
+
+
+// Once a thread has run out of its own chunks it takes the last chunk of whichever thread has the most left.
+// Taking from the end means the other thread's buckets and carried offsets stay valid for the chunks it keeps.
+static int stealChunk(ThreadDescriptor * thread, size_t * chunkNum) {
+    for (;;) {
+        ThreadDescriptor * victim = NULL;
+        size_t most = 0;
+        for (int i = 0; i < threadCount; ++i) {
+            ThreadDescriptor * other = threads + i;
+            if (other == thread) continue;
+            pthread_mutex_lock(&other->claimMutex);
+            size_t remaining = (other->endChunk - other->nextChunk) / threadCount;
+            pthread_mutex_unlock(&other->claimMutex);
+            if (remaining > most) {
+                most = remaining;
+                victim = other;
+            }
+        }
+        if (!victim) return 0;
 
-    free(bitmap);
+        pthread_mutex_lock(&victim->claimMutex);
+        int claimed = victim->nextChunk < victim->endChunk;
+        if (claimed) {
+            victim->endChunk -= threadCount;
+            *chunkNum = victim->endChunk;
+        }
+        pthread_mutex_unlock(&victim->claimMutex);
+        if (claimed) {
+            if (verbose) stdLog("Taking chunk %zd from thread %d", *chunkNum, victim->threadNum);
+            return 1;
+        }
+    }
 }
 
 
@@ -738,37 +3216,49 @@ static void * processAllChunks(void * threadPt) {
     ThreadDescriptor * thread = (ThreadDescriptor*) threadPt;
     pthread_setspecific(threadNumKey, &thread->threadNum);
     if (!silent) stdLog("Thread %d started", thread->threadNum);
-    Prime from, to;
-    prime_cp(from, startValue);
-    //Prime to = startValue - (startValue % chunkSize) + chunkSize;
-    prime_mod_prime(to, startValue, chunkSize);
-    prime_sub_prime(to, startValue, to);
-    prime_add_prime(to, to, chunkSize);
-
-    int chunkNum = 0;
-    while (prime_lt(to, endValue)) {
-        if (chunkNum % threadCount == (thread->threadNum - 1)) {
-            if (singleFile) process(from, to, theSingleFile);
-            else {
-                int file = openFileForPrime(from, to);
-                process(from, to, file);
-                closeFileForPrime(file);
-            }
+
+    thread->primeOffsets = mallocSafe((carryPrimeEnd - lowPrimeCount + 1) * sizeof(size_t));
+    thread->carriedChunk = SIZE_MAX;
+    thread->segmentWheelPositions = useWheel ? mallocSafe(segmentPrimeEnd - lowPrimeCount + 1) : NULL;
+    thread->buckets = NULL;
+    thread->bucketCount = 0;
+    thread->bitmap = NULL;
+    initAsyncWriter(&thread->asyncWriter);
+    initSpliceWriter(&thread->spliceWriter);
+    initDirectWriter(&thread->directWriter);
+    thread->spareBuffers = NULL;
+    thread->primes = primes;
+    thread->preSievePatterns = preSievePatterns;
+    if (threadCpus) pinThread(thread);
+    if (nodeReplicas) useNodeReplica(thread);
+    size_t firstChunk = thread->threadNum - 1;
+    if (bucketPrimeStart < bucketPrimeEnd && firstChunk < bucketChunkTotal) {
+        Prime firstFrom;
+        if (firstChunk == 0) {
+            prime_cp(firstFrom, startValue);
         }
-        prime_cp(from,to);
-        prime_add_prime(to, to, chunkSize);
-        chunkNum++;
-    }
-    if (prime_lt(from, endValue)) {
-        if (chunkNum % threadCount == (thread->threadNum - 1)) {
-            if (singleFile) process(from, endValue, theSingleFile);
-            else {
-                int file = openFileForPrime(from, endValue);
-                process(from, endValue, file);
-                closeFileForPrime(file);
-            }
+        else {
+            prime_set_num(firstFrom, firstChunk);
+            prime_mul_prime(firstFrom, firstFrom, chunkSize);
+            prime_add_prime(firstFrom, firstFrom, chunkOrigin);
         }
+        fileBucketPrimes(thread, firstChunk, firstFrom);
     }
+
+    size_t chunkNum;
+    while (claimChunk(thread, &chunkNum)) processChunk(thread, chunkNum);
+    while (stealChunk(thread, &chunkNum)) processChunk(thread, chunkNum);
+    finishSieving();
+    if (fileType == FILE_TYPE_TEXT && threadCount > 1) helpFormatText();
+
+    if (thread->buckets) freeBuckets(thread);
+    free(thread->primeOffsets);
+    free(thread->segmentWheelPositions);
+    if (thread->bitmap) freeLarge(thread->bitmap, thread->bitmapSize);
+    finalAsyncWriter(&thread->asyncWriter);
+    finalSpliceWriter(&thread->spliceWriter, &thread->spareBuffers);
+    freeOutputBuffers(thread->spareBuffers);
+    finalDirectWriter(&thread->directWriter);
     if (!silent) stdLog("Thread %d finished", thread->threadNum);
     return NULL;
 }
@@ -779,6 +3269,34 @@ static void * processAllChunks(void * threadPt) {
 void runThreads() {
     threads = mallocSafe(sizeof(struct ThreadDescriptor) * threadCount);
 
+    // chunkTotal = (endValue - chunkOrigin + chunkSize - 1) / chunkSize
+    chunkTotal = 0;
+    if (prime_lt(startValue, endValue)) {
+        Prime tmp, limit;
+        prime_sub_prime(tmp, endValue, chunkOrigin);
+        prime_add_prime(tmp, tmp, chunkSize);
+        prime_sub_num(tmp, tmp, 1);
+        prime_div_prime(tmp, tmp, chunkSize);
+        prime_set_num(limit, SIZE_MAX - threadCount);
+        if (prime_gt(tmp, limit)) exitError(1, 0, "Too many chunks, use a larger chunk size");
+        chunkTotal = prime_get_num(tmp);
+    }
+    nextWriteChunk = 0;
+    sievingThreads = threadCount;
+    orderedOutput = singleFile && threadCount > 1;
+    preallocateFiles = !singleFile && !useStdout && !outputProcessor;
+
+    // Share the chunks out, threads that finish their own early will take chunks from the others
+    for (int threadNum = 0; threadNum < threadCount; ++threadNum) {
+        ThreadDescriptor * thread = threads + threadNum;
+        pthread_mutex_init(&thread->claimMutex, NULL);
+        thread->nextChunk = threadNum;
+        thread->endChunk = threadNum;
+        if (thread->nextChunk < chunkTotal) {
+            thread->endChunk += ((chunkTotal - threadNum + threadCount - 1) / threadCount) * threadCount;
+        }
+    }
+
     if (threadCount == 1) {
         if (!silent) stdLog("Running single threaded");
         threads[0].threadNum = 1;
@@ -787,15 +3305,11 @@ void runThreads() {
     }
     else{
     if (!silent) stdLog("Running multithread with %d threads", threadCount);
-        if (singleFile && threadCount > 1) {
-            // initialise the semaphores.
-            // these will be used to sequence the writes correctly.
-            sem_init(&(threads[0].writeSemaphore), 0, 1);
-            for (int threadNum = 1; threadNum < threadCount; ++threadNum) {
-                sem_init(&(threads[threadNum].writeSemaphore), 0, 0);
-                threads[threadNum-1].nextThreadWriteSemaphore = &threads[threadNum].writeSemaphore;
-            }
-            threads[threadCount-1].nextThreadWriteSemaphore = &threads[0].writeSemaphore;
+        if (orderedOutput) {
+            pendingChunks = NULL;
+            queuedBytes = 0;
+            queuedByteLimit = (size_t) REORDER_BUFFER_SIZE * threadCount;
+            pthread_create(&writerThread, NULL, writeOrderedOutput, NULL);
         }
 
         // Run all of the threads.
@@ -811,16 +3325,15 @@ void runThreads() {
             int * returnValue;
             pthread_join(threads[threadNum].threadHandle, (void**)&returnValue);
         }
-        if (singleFile && threadCount > 1) {
-            for (int threadNum = 0; threadNum < threadCount; ++threadNum) {
-                sem_destroy(&threads[threadNum].writeSemaphore);
-            }
-        }
+        if (orderedOutput) pthread_join(writerThread, NULL);
         if (exitStatus != 0) exit(exitStatus);
     }
 
     if (!silent) stdLog("All threads now terminated", threadCount);    
     
+    // The main thread may have been used as thread 1
+    pthread_setspecific(threadNumKey, NULL);
+    for (int threadNum = 0; threadNum < threadCount; ++threadNum) pthread_mutex_destroy(&threads[threadNum].claimMutex);
     free(threads);
 }
 
@@ -848,6 +3361,15 @@ int main(int argC, char ** argV) {
         case FILE_TYPE_HEAD_ONLY:
             writePrime = writePrimeStatsOnly;
             break;
+
+        case FILE_TYPE_GAP_CODED:
+            writePrime = writePrimeGapCoded;
+            break;
+    }
+
+    if (useWheel) {
+        bitmapSpan = WHEEL_SPAN;
+        bitmapResidues = wheelResidues;
     }
 
 
@@ -855,10 +3377,17 @@ int main(int argC, char ** argV) {
         theSingleFile = openFileForPrime(startValue, endValue);
     }
 
+    if (affinity) setupAffinity();
+
     // Initialise the primes array
-    if (initFileName) exitError(1,0,"Init from file was removed in V1.2");
-    initializeSelf();
+    setMaxSievingPrime();
+    if (initFileName) loadInitFile();
+    else initializeSelf();
+    if (saveInitFileName) saveInitFile();
     populateLowPrimeMap();
+    setupBuckets();
+    setupSegments();
+    setupCarry();
 
     // Set the debug mask, this is used for verbose priting
     if (verbose) {
@@ -875,6 +3404,7 @@ int main(int argC, char ** argV) {
 
     // Free the primes array
     finalSelf();
+    reportHugePages();
 
     // Close the file (this can take some time if it has been cached by the os)
     if (singleFile) {
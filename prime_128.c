@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "prime_shared.h"
+#include "shared.h"
+
+
+Prime _str_to_prime(char * s) {
+    Prime value = 0;
+    Prime max = ~((Prime) 0);
+
+    if (!*s) exitError(1, 0, "invalid number %s", s);
+    for (char * pos = s; *pos; ++pos) {
+        if (*pos < '0' || *pos > '9') exitError(1, 0, "invalid number %s", s);
+        unsigned int digit = *pos - '0';
+        if (value > (max - digit) / 10) exitError(1, 0, "invalid number %s", s);
+        value = value * 10 + digit;
+    }
+
+    return value;
+}
+
+
+
+int prime_to_str(char * s, Prime value) {
+    // Digits are found least significant first then reversed
+    int length = 0;
+    do {
+        s[length++] = '0' + (int) (value % 10);
+        value /= 10;
+    } while (value);
+    s[length] = '\0';
+    for (int i = 0; i < length / 2; ++i) {
+        char tmp = s[i];
+        s[i] = s[length - 1 - i];
+        s[length - 1 - i] = tmp;
+    }
+    return length;
+}
+
+
+
+// Integer square root (rounded down) worked one bit of the result at a time
+Prime _prime_sqrt(Prime value) {
+    Prime result = 0;
+    Prime bit = ((Prime) 1) << 126;
+    while (bit > value) bit >>= 2;
+    while (bit) {
+        if (value >= result + bit) {
+            value -= result + bit;
+            result = (result >> 1) + bit;
+        }
+        else {
+            result >>= 1;
+        }
+        bit >>= 2;
+    }
+    return result;
+}
@@ -0,0 +1,53 @@
+#ifndef prime_int128_h
+#define prime_int128_h
+
+#include <stdint.h>
+
+#define PRIME_ARCHITECTURE Unsigned 128 Bit Int
+
+#define PRIME_LIMB_SIZE sizeof(long long)
+#define PRIME_LIMB_COUNT ((size_t) 2)
+
+typedef unsigned __int128 Prime;
+
+// Sieving primes never exceed the square root of a Prime
+typedef uint64_t SievePrime;
+
+#define prime_set_num(target, value) target = (Prime) ( value )
+#define prime_get_num(value) ( (unsigned long long) ( value ) )
+#define str_to_prime(target, value) target = _str_to_prime(value)
+Prime _str_to_prime(char * s);
+int prime_to_str(char * s, Prime value);
+
+#define prime_add_num(target, in1, in2) ( target = in1 + ( in2 ) )
+#define prime_add_prime(target, in1, in2) ( target = in1 + in2 )
+#define prime_sub_num(target, in1, in2) ( target = in1 - ( in2 ) )
+#define prime_sub_prime(target, in1, in2) ( target = in1 - in2 )
+
+
+#define prime_mul_prime(target, value1, value2) ( target =  value1 * value2 )
+#define prime_mul_num(target, value1, value2) ( target = value1 * ( value2 ) )
+#define prime_mul_16(target, value1) ( target = value1 << 4 )
+#define prime_div_prime(div, in1, in2) ( div = in1 / in2 )
+#define prime_div_num(div, in1, in2) ( div = in1 / ( in2 ) )
+#define prime_div_16(div, in1) ( div = in1 >> 4)
+#define prime_mod_prime(mod, in1, in2) ( mod = in1 % in2 )
+#define prime_mod_num(mod, in1, in2) ( mod = in1 % ( in2 ) )
+
+
+#define prime_sqrt(target, value) target = _prime_sqrt(value)
+Prime _prime_sqrt(Prime value);
+
+
+#define prime_gt(v1,v2) ( v1 >  v2 )
+#define prime_ge(v1,v2) ( v1 >= v2 )
+#define prime_lt(v1,v2) ( v1 <  v2 )
+#define prime_le(v1,v2) ( v1 <= v2 )
+#define prime_eq(v1,v2) ( v1 == v2 )
+
+#define prime_is_odd(v1)  ( v1 & 1 )
+
+#define prime_cp(target,result) ( target = result )
+
+
+#endif // prime_int128_h
@@ -1,6 +1,8 @@
 #ifndef prime_long_long_h
 #define prime_long_long_h
 
+#include <stdint.h>
+
 #define PRIME_ARCHITECTURE Unsigned Long Long Int
 
 #define PRIME_LIMB_SIZE sizeof(long long) 
@@ -8,6 +10,9 @@
 
 typedef unsigned long long Prime;
 
+// Sieving primes never exceed the square root of a Prime
+typedef uint32_t SievePrime;
+
 #define prime_set_num(target, value) target = value
 #define prime_get_num(value) ( value )
 #define str_to_prime(target, value) target = _str_to_prime(value)
@@ -2,6 +2,7 @@
 #define PRIME_GMP_H
 
 #include <gmp.h>
+#include <stdint.h>
 
 #define PRIME_ARCHITECTURE GMP
 
@@ -10,6 +11,9 @@
 #define PRIME_LIMB_COUNT ( PRIME_SIZE / PRIME_LIMB_SIZE / 8 )
 typedef mp_limb_t Prime[PRIME_LIMB_COUNT];
 
+// Sieving primes never exceed the square root of a Prime (no more than 128 bits)
+typedef uint64_t SievePrime;
+
 int prime_to_str(char * s, Prime prime);
 void str_to_prime(Prime prime, char * s);
 void prime_set_num(Prime prime, mp_limb_t in);
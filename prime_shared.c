@@ -1,6 +1,13 @@
+// For O_DIRECT
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "prime_shared.h"
 
+#ifndef _XOPEN_SOURCE
 #define  _XOPEN_SOURCE
+#endif
 #include <time.h>
 
 #include <stdlib.h>
@@ -11,6 +18,7 @@
 #include <stdarg.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #include <sys/file.h>
 #include <sys/stat.h>
@@ -38,9 +46,17 @@ char * dirName;
 char * fileName;
 char * outputProcessor;
 char * initFileName;
+char * saveInitFileName;
 int useStdout;
 int singleFile;
 int fileType = FILE_TYPE_TEXT;
+int useWheel;
+int useHugePages;
+char * affinity;
+int replicateNuma;
+int useIoUring;
+int useSplice;
+int directIo;
 
 char ** inputFiles;
 int inputFileCount;
@@ -216,6 +232,10 @@ int openFileForPrime(Prime from, Prime to) {
         if (!silent) stdLog("Starting new prime file: %s", formattedFileName);
         file = open(formattedFileName, O_WRONLY | O_CREAT | ( allowClobber ? O_TRUNC : O_EXCL ), 0644);
         if (file == -1) exitError(2, errno, "Could not create new file: %s", formattedFileName);
+
+        // Not every file system supports O_DIRECT, so it is set once the file exists rather than failing the open
+        if (directIo && !outputProcessor && fcntl(file, F_SETFL, fcntl(file, F_GETFL) | O_DIRECT))
+            logWarning(errno, "Could not use direct I/O for %s, writing through the page cache", formattedFileName);
     }
 
     if (outputProcessor) {
@@ -308,6 +328,8 @@ static void printUsage(int argC, char ** argV) {
             "  -B --compressed-out      Write compressed binary output - the smallest file possible\n"
             "                           The format of this file is unique to prime programs\n"
             "                           It is NOT gzip or bzip2 format!\n"
+            "  -g --gap-coded-out       Write the gaps between primes, smaller than -B for large primes\n"
+            "                           Like -B read this back with prime-decompress\n"
             "  -d --directory           Specify the output directory, will be ignored if file name\n"
             "                           starts with /\n"
             "  -n --file-name           Specify the file name as a pattern\n"
@@ -315,6 +337,9 @@ static void printUsage(int argC, char ** argV) {
             "  -f --single-file         Write to a new file\n"
             "  -F --multi-file          Write to one file per chunk\n"
             "  -p --use-stdout          Write to the stdout, will not create files\n"
+            "  -U --io-uring            Write through io_uring so sieving carries on while output is written\n"
+            "  -Z --splice              Hand output to pipes with vmsplice() and to files with splice()\n"
+            "  -D --direct-io           Write files with O_DIRECT, bypassing the page cache\n"
             "  -k --clobber             Allow overwriting of existing files\n"
             "  -I --create-init-file    Equivalent to -bfs 3 -n init-%%9e9OG.dat\n"
             "  -P --post-process        Pipes all content through a command (eg: gzip)\n"
@@ -326,10 +351,18 @@ static void printUsage(int argC, char ** argV) {
             "                           suffix this with k,m,g,t to multiply by\n"
             "                           one thousand, million, billion or trillion\n"
             "                           (affects file size when using -F)\n"
-            "  -l --low-prime-max       The maximum value for low primes.\n"
-            "                           This can not be set above 23\n"
+            "  -l --low-prime-max       The maximum value for low primes (default %d).\n"
+            "                           This can not be set above %d\n"
             "  -x --threads             Specify the number of threads to use (default 1)\n"
-            "  -i --init-file           Specify an initialisation file generated with -b previously\n"
+            "  -W --wheel               Skip multiples of 2, 3 and 5 in bitmaps (mod 30 wheel)\n"
+            "                           instead of just multiples of 2\n"
+            "  -i --init-file           Load the sieving primes from an initialisation file instead of\n"
+            "                           generating them.  Accepts files written by -j, -b, -B or -g\n"
+            "  -j --save-init-file      Write the sieving primes to an initialisation file for -i\n"
+            "  -H --huge-pages          Back bitmaps and the sieving primes with 2MB pages\n"
+            "  -A --affinity            Pin each thread to a cpu: compact, scatter or a list (eg: 0,2,4-7)\n"
+            "  -N --numa-replicate      Give each NUMA node its own copy of the sieving primes\n"
+            "                           (implies -A compact unless -A is given)\n"
             "\n"
 #ifndef STRIP_LOGGING
             "Debug & logging options:\n"
@@ -339,7 +372,7 @@ static void printUsage(int argC, char ** argV) {
 #endif
             "Other:\n"
             "  -h --help                 Show this help and exit\n"
-            "  -V --version              Print the program version and exit\n", argV[0]);
+            "  -V --version              Print the program version and exit\n", argV[0], LOW_PRIME_DEFAULT, LOW_PRIME_LIMIT);
 }
 
 
@@ -395,6 +428,13 @@ void parseArgs(int argC, char ** argV) {
     useStdout  = 0;
     singleFile = 0;
     fileType   = FILE_TYPE_TEXT;
+    useWheel   = 0;
+    useHugePages = 0;
+    affinity     = NULL;
+    replicateNuma = 0;
+    useIoUring   = 0;
+    useSplice    = 0;
+    directIo     = 0;
 
 #ifndef STRIP_LOGGING
     silent  = 0;
@@ -404,13 +444,14 @@ void parseArgs(int argC, char ** argV) {
     prime_set_num(startValue, 0);
     prime_set_num(endValue,   1000000000);
     prime_set_num(chunkSize,  1000000000);
-    prime_set_num(lowPrimeMax,19);
+    prime_set_num(lowPrimeMax,LOW_PRIME_DEFAULT);
     
 
     dirName      = "";
     fileName     = defaultFileNames[3];
     allowClobber = 0;
     initFileName = NULL;
+    saveInitFileName = NULL;
 
     
     static struct option longOptions[] = {
@@ -422,6 +463,7 @@ void parseArgs(int argC, char ** argV) {
             { "directory", required_argument, 0, 'd'},
             { "file-name", required_argument, 0, 'n'},
             { "init-file", required_argument, 0, 'i'},
+            { "save-init-file", required_argument, 0, 'j'},
             { "post-process", required_argument, 0, 'P'},
 #ifndef STRIP_LOGGING
             { "quiet", no_argument, 0, 'q' },
@@ -433,6 +475,14 @@ void parseArgs(int argC, char ** argV) {
             { "text-out", no_argument, 0, 'a' },
             { "binary-out", no_argument, 0, 'b' },
             { "compressed-out", no_argument, 0, 'B'},
+            { "gap-coded-out", no_argument, 0, 'g'},
+            { "wheel", no_argument, 0, 'W'},
+            { "huge-pages", no_argument, 0, 'H'},
+            { "affinity", required_argument, 0, 'A'},
+            { "numa-replicate", no_argument, 0, 'N'},
+            { "io-uring", no_argument, 0, 'U'},
+            { "splice", no_argument, 0, 'Z'},
+            { "direct-io", no_argument, 0, 'D'},
             { "stats-out", no_argument, 0, 'S'},
             { "clobber", no_argument, 0, 'k'},
             { "create-init-file", no_argument, 0, 'I'},
@@ -442,9 +492,9 @@ void parseArgs(int argC, char ** argV) {
     };
 
 #ifndef STRIP_LOGGING
-    static char * shortOptions = "s:e:c:d:n:i:x:P:qvfFpabBhkIV";
+    static char * shortOptions = "s:e:c:d:n:i:j:x:P:l:A:qvfFpabBgSWHNUZDhkIV";
 #else
-    static char * shortOptions = "s:e:c:d:n:i:x:P:fFpabBhkIV";
+    static char * shortOptions = "s:e:c:d:n:i:j:x:P:l:A:fFpabBgSWHNUZDhkIV";
 #endif
     int givenOption;
     // do not allow getopt_long to print an error to stdout if an invalid option is found
@@ -458,10 +508,10 @@ void parseArgs(int argC, char ** argV) {
             long value;
             char * endptr;
             value = strtol(optarg, &endptr, 10);
-            if (*endptr || value < 0 || value > 23) {
+            if (*endptr || value < 0 || value > LOW_PRIME_LIMIT) {
                 exitError(1, 0,
-                        "max low prime %s is invalid. Must be between 1 and 21",
-                        optarg);
+                        "max low prime %s is invalid. Must be between 1 and %d",
+                        optarg, LOW_PRIME_LIMIT);
             }
             prime_set_num(lowPrimeMax, value);
             break;
@@ -478,10 +528,19 @@ void parseArgs(int argC, char ** argV) {
         case 'a': fileType = FILE_TYPE_TEXT;                      break;
         case 'b': fileType = FILE_TYPE_SYSTEM_BINARY;             break;
         case 'B': fileType = FILE_TYPE_COMPRESSED_BINARY;         break;
+        case 'W': useWheel = 1;                                   break;
+        case 'H': useHugePages = 1;                               break;
+        case 'A': affinity = optarg;                              break;
+        case 'N': replicateNuma = 1;                              break;
+        case 'U': useIoUring = 1;                                 break;
+        case 'Z': useSplice = 1;                                  break;
+        case 'D': directIo = 1;                                   break;
         case 'S': fileType = FILE_TYPE_HEAD_ONLY;                 break;
+        case 'g': fileType = FILE_TYPE_GAP_CODED;                 break;
         case 'd': dirName  = optarg;                              break;
         case 'n': fileName = optarg;                              break;
         case 'i': initFileName = optarg;                          break;
+        case 'j': saveInitFileName = optarg;                      break;
         case 'I': fileType = FILE_TYPE_SYSTEM_BINARY; 
                   useStdout = 0; singleFile = 1; 
                   prime_set_num(startValue, 3);                   
@@ -522,6 +581,7 @@ void parseArgs(int argC, char ** argV) {
         strcpy(tmpFileName, fileName);
         if (fileType == FILE_TYPE_TEXT) strcat(tmpFileName,"txt");
         else if (fileType == FILE_TYPE_COMPRESSED_BINARY) strcat(tmpFileName,"primefile");
+        else if (fileType == FILE_TYPE_GAP_CODED) strcat(tmpFileName,"primegaps");
         else strcat(tmpFileName,"dat");
         fileName = tmpFileName;
     }
@@ -532,6 +592,12 @@ void parseArgs(int argC, char ** argV) {
 
     if (threadCount < 1) exitError(1, 0, "invalid thread-count (%d). Must be 1 or more.", threadCount);
 
+    if (useSplice && useIoUring) exitError(1, 0, "--splice and --io-uring can not be used together");
+    if (directIo && (useSplice || useIoUring)) exitError(1, 0, "--direct-io can not be used with --splice or --io-uring");
+
+    // Copies per NUMA node are only local to threads which stay on that node
+    if (replicateNuma && !affinity) affinity = "compact";
+
     if (outputProcessor) {
         if (singleFile) {
             outputProcessors = mallocSafe(sizeof(ChildProcess));
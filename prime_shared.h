@@ -13,7 +13,7 @@
     #define PRIME_SIZE 64
 #endif
 
-#if ! defined PRIME_ARCH_INT && ! defined PRIME_ARCH_GMP
+#if ! defined PRIME_ARCH_INT && ! defined PRIME_ARCH_GMP && ! defined PRIME_ARCH_INT128
     #define PRIME_ARCH_INT
 #endif
 
@@ -43,6 +43,8 @@
     #include "prime_64.h"
 #elif defined PRIME_ARCH_GMP
     #include "prime_gmp.h"
+#elif defined PRIME_ARCH_INT128
+    #include "prime_128.h"
 #else
     #error PRIME_ARCH is invalid
 #endif
@@ -66,17 +68,32 @@ extern Prime lowPrimeMax;
 extern int threadCount;
 
 extern char * initFileName;
+extern char * saveInitFileName;
+extern int allowClobber;
 extern char * fileName;
 extern int singleFile;
 extern int useStdout;
+extern char * outputProcessor;
 extern int fileType;
+extern int useWheel;
+extern int useHugePages;
+extern char * affinity;
+extern int replicateNuma;
+extern int useIoUring;
+extern int useSplice;
+extern int directIo;
 extern char ** inputFiles;
 extern int inputFileCount;
 
+// The default and the largest value accepted for --low-prime-max
+#define LOW_PRIME_DEFAULT 97
+#define LOW_PRIME_LIMIT 251
+
 #define FILE_TYPE_TEXT 't'
 #define FILE_TYPE_SYSTEM_BINARY 'b'
 #define FILE_TYPE_COMPRESSED_BINARY 'c'
 #define FILE_TYPE_HEAD_ONLY 'h'
+#define FILE_TYPE_GAP_CODED 'g'
 
 char * formatFileNamePart(char * formattedFileName, int bufferSize, const char * source, Prime from, Prime to);
 char * formatFileName( char * formattedFileName, int bufferSize, Prime from, Prime to);